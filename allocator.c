@@ -1,13 +1,25 @@
 /* Richard James Howe, Email: howe.r.j.89@gmail.com, Public Domain, https:github.com/howerj/allocator */
 
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE /* for 'madvise' and MAP_ANONYMOUS */
+#endif
 #include <assert.h>
 #include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <stdarg.h>
 #include "allocator.h"
 
 /* TODO: Size checks, formatting, tracing options, algorithm selection, tests, version number, canaries,
- * examples (memory mapping/file backed/pickle TCL interpreter) */
+ * examples (pickle TCL interpreter) */
+/* NOTE: Formatting an arena only writes to the header and the metadata the
+ * arena type needs, the rest of the buffer is left untouched until it is
+ * allocated, which allows large lazily committed (e.g. mmap'ed) buffers to be
+ * used without faulting in every page. Use ALLOCATOR_FLAG_ZERO if allocations
+ * need to be zeroed. */
 /* TODO: Experiment with a different API, could just pass around "buf/len" instead of arena? Or just
  * buf once it has been setup as the length can be stored within buf. */
 
@@ -19,16 +31,277 @@
 #define UNUSED(X)               ((void)(X))
 #define BUILD_BUG_ON(condition) ((void)sizeof(char[1 - 2*!!(condition)]))
 #define check(EXP)              assert(EXP)
+#ifdef __GNUC__
+#define CALLER                  (__builtin_return_address(0))
+#else
+#define CALLER                  (NULL)
+#endif
 #define implies(P, Q)           implication(!!(P), !!(Q)) /* material implication, immaterial if NDEBUG defined */
 #define mutual(P, Q)            (implies((P), (Q)), implies((Q), (P)))
 
+#ifndef ALLOCATOR_MMAP /* are 'mmap' and friends available for file backed and virtual arenas? */
+#if defined(__unix__) || defined(__APPLE__)
+#define ALLOCATOR_MMAP          (1)
+#else
+#define ALLOCATOR_MMAP          (0)
+#endif
+#endif
+
+#ifndef ALLOCATOR_PAGE
+#define ALLOCATOR_PAGE          (4096u)
+#endif
+#ifndef ALLOCATOR_HUGE_PAGE
+#define ALLOCATOR_HUGE_PAGE     (2u * 1024u * 1024u)
+#endif
+#ifndef ALLOCATOR_RELEASE_MIN /* smallest span of free pages worth giving back with ALLOCATOR_FLAG_RELEASE */
+#define ALLOCATOR_RELEASE_MIN   (ALLOCATOR_PAGE * 16u)
+#endif
+
+#if ALLOCATOR_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifndef ALLOCATOR_CLOCK /* is 'clock_gettime' available to timestamp recorded events? */
+#define ALLOCATOR_CLOCK         ALLOCATOR_MMAP
+#endif
+
+#if ALLOCATOR_CLOCK
+#include <time.h>
+#endif
+
+#ifndef ALLOCATOR_PTHREADS /* can the tests start threads with 'pthread_create'? */
+#define ALLOCATOR_PTHREADS      ALLOCATOR_MMAP
+#endif
+
+#if ALLOCATOR_PTHREADS
+#include <pthread.h>
+#endif
+
+#ifndef ALLOCATOR_YIELD /* can a thread waiting on a lock give up the CPU with 'sched_yield'? */
+#define ALLOCATOR_YIELD         ALLOCATOR_MMAP
+#endif
+
+#if ALLOCATOR_YIELD
+#include <sched.h>
+#endif
+
+#ifndef ALLOCATOR_ATOMICS /* are atomic builtins available for ALLOCATOR_FLAG_THREAD_SAFE? */
+#ifdef __GNUC__
+#define ALLOCATOR_ATOMICS       (1)
+#else
+#define ALLOCATOR_ATOMICS       (0)
+#endif
+#endif
+
+/* The list allocator is a Two Level Segregated Fit (TLSF) allocator, free
+ * blocks are binned by size into a first level of power-of-two classes, each
+ * of which is split linearly into LIST_SL_COUNT second level classes. A bitmap
+ * for each level allows a suitable non-empty free list to be found with a
+ * couple of bit scans, so allocation and deallocation take constant time. All
+ * links are stored as offsets from the start of the arena, offset zero is
+ * never a block (the list control structures live there) so it is used as
+ * the NULL offset. */
+#define LIST_SL_LOG2            (4u)
+#define LIST_SL_COUNT           (1u << LIST_SL_LOG2)
+#define LIST_FREE               (1u) /* block flag: this block is free */
+#define LIST_PREV_FREE          (2u) /* block flag: previous physical block is free */
+#define LIST_FLAGS              (LIST_FREE | LIST_PREV_FREE)
+#define LIST_HDR                ((size_t)alignup(sizeof (lblock_t)))
+#define LIST_MIN                (LIST_HDR + (size_t)alignup(sizeof (lfree_t)))
+#define LIST_SMALL              ((size_t)ALLOCATOR_ALIGNMENT << LIST_SL_LOG2)
+#define POOL_BITS               (sizeof (size_t) * CHAR_BIT)
+#define LOCK_SPIN_MAX           (64u) /* most pauses between tries at a held lock before yielding instead */
+
+typedef struct { /* header for every block in the list arena */
+	size_t prev; /* offset of previous physical block */
+	size_t size; /* size of block including header, lower bits are flags */
+} lblock_t;
+
+typedef struct { /* stored in the payload of free blocks only */
+	size_t next, prev; /* offsets of next and previous free blocks in class */
+} lfree_t;
+
+/* With ALLOCATOR_FLAG_SIZED the caller promises to pass the exact 'oldsz',
+ * which is used to tell small objects apart, these have no header and are
+ * packed into slabs: list blocks aligned to their own size with a bitmap at
+ * the front, so the slab an object is in is found by masking its address.
+ * Slabs with free slots are kept on a list per size class. As alignment is
+ * by address, attaching a sized arena fails unless it is at the same offset
+ * within a slab, which is the case for page aligned mappings. If
+ * ALLOCATOR_VERIFY_SIZE is set (the default unless NDEBUG is) frees are
+ * checked against the slab. */
+#ifndef ALLOCATOR_SLAB_MAX
+#define ALLOCATOR_SLAB_MAX      (64u) /* largest object without a header */
+#endif
+#ifndef ALLOCATOR_SLAB_SIZE
+#define ALLOCATOR_SLAB_SIZE     (4096u)
+#endif
+#ifndef ALLOCATOR_VERIFY_SIZE
+#ifdef NDEBUG
+#define ALLOCATOR_VERIFY_SIZE   (0)
+#else
+#define ALLOCATOR_VERIFY_SIZE   (1)
+#endif
+#endif
+#define SLAB_CLASSES            ((ALLOCATOR_SLAB_MAX + ALLOCATOR_ALIGNMENT - 1u) / ALLOCATOR_ALIGNMENT)
+#define SLAB_UNITS              (((ALLOCATOR_SLAB_SIZE / ALLOCATOR_ALIGNMENT) + POOL_BITS - 1u) / POOL_BITS)
+#define SLAB_HDR                ((size_t)alignup(sizeof (slab_t)))
+#define SLAB_MAGIC              ((size_t)0x534C4142ul)
+
+typedef struct { /* at the start of every slab */
+	size_t magic;
+	size_t next, prev; /* offsets of other slabs of this class with free slots */
+	size_t size;       /* object size */
+	size_t used;       /* objects allocated */
+	size_t map[SLAB_UNITS]; /* a set bit is an allocated slot */
+} slab_t;
+
+typedef struct {
+	size_t fl_map;   /* first level bitmap, a bit set for each non-empty class */
+	size_t fl_count; /* number of first level classes, depends on arena size */
+	size_t sl_map;   /* offset of second level bitmaps, one per first level class */
+	size_t heads;    /* offset of free list heads, 'fl_count * LIST_SL_COUNT' of them */
+	size_t start;    /* offset of first block */
+	size_t end;      /* offset of sentinel block, which is always in use */
+	size_t free;     /* bytes in free blocks, including their headers */
+	size_t slabs[SLAB_CLASSES]; /* offsets of slabs with free slots */
+	size_t sized;      /* objects in slabs */
+	size_t slab_bytes; /* bytes in blocks used as slabs */
+	size_t slab_used;  /* bytes in objects in slabs */
+	size_t phase;      /* address of the arena modulo ALLOCATOR_SLAB_SIZE when formatted */
+} list_t;
+
+/* The pool allocator splits the arena into equally sized regions, one for
+ * each power-of-two size class from POOL_MIN up, each region contains a
+ * bitmap (a set bit is an allocated block) followed by blocks of that size.
+ * As all regions are the same size the class of a pointer can be found by
+ * division, no headers are needed. This is the block allocator from
+ * 'docs/block.c' with all of its metadata placed in the arena. */
+#ifndef ALLOCATOR_POOL_CLASSES
+#define ALLOCATOR_POOL_CLASSES  (8u)
+#endif
+#define POOL_MIN                ((size_t)ALLOCATOR_ALIGNMENT)
+
+typedef struct {
+	size_t map;    /* offset of free bitmap */
+	size_t blocks; /* offset of first block */
+	size_t count;  /* number of blocks */
+	size_t hint;   /* bitmap unit to start searching from */
+	int lock;      /* taken when searching and updating the bitmap */
+} pclass_t;
+
+typedef struct {
+	size_t start;  /* offset of first region */
+	size_t region; /* length of each region */
+	size_t avail;  /* bitmap of classes with free blocks */
+	size_t used, free; /* bytes in allocated and free blocks */
+	pclass_t classes[ALLOCATOR_POOL_CLASSES];
+} pool_t;
+
+/* The buddy allocator manages blocks that are power-of-two multiples of
+ * BUDDY_MIN, larger blocks are split in half to satisfy a request and a
+ * freed block is merged with its buddy (found by flipping one bit of its
+ * offset) for as long as the buddy is free. The arena is tiled with a root
+ * block for each set bit of its size in units, so none of it is lost to
+ * rounding, and the root a unit is in is given by the highest bit that the
+ * unit and the size differ in. Each node of the trees has a bit in a split
+ * and a free bitmap, node 'i' of order 'k' being bit '(span >> k) + i', so
+ * no headers are needed, the order of a block is found by walking down from
+ * its root through the split nodes. The first block is page aligned (less
+ * for small arenas) so blocks are aligned to their size up to a page. */
+#define BUDDY_MIN               ((size_t)ALLOCATOR_ALIGNMENT * 2u)
+
+typedef struct {
+	size_t heads;     /* offset of free list heads, one per order */
+	size_t split_map; /* offset of bitmap of split nodes */
+	size_t free_map;  /* offset of bitmap of free blocks */
+	size_t start;     /* offset of first block */
+	size_t units;     /* number of BUDDY_MIN units managed */
+	size_t span;      /* 'units' rounded up to a power of two */
+	size_t orders;    /* number of orders, a block of order 'k' is 'BUDDY_MIN << k' bytes */
+	size_t avail;     /* bitmap of orders with free blocks */
+	size_t used, free; /* bytes in allocated and free blocks */
+} buddy_t;
+
+/* A cache arena sits in front of another (usually thread safe) arena, it
+ * is meant to be owned by a single thread. Small allocations are rounded up
+ * to a power-of-two class and freed blocks are kept on a per-class stack (a
+ * magazine), which is refilled from, or half flushed back to, the shared
+ * arena in batches. Caches rely on callers passing the correct 'oldsz'. */
+#ifndef ALLOCATOR_CACHE_CLASSES
+#define ALLOCATOR_CACHE_CLASSES (5u) /* 16 to 256 bytes if aligned to 16 bytes */
+#endif
+#ifndef ALLOCATOR_CACHE_DEPTH
+#define ALLOCATOR_CACHE_DEPTH   (32u)
+#endif
+#define CACHE_MAX               (POOL_MIN << (ALLOCATOR_CACHE_CLASSES - 1u))
+#define CACHE_BATCH             (ALLOCATOR_CACHE_DEPTH / 2u)
+
+typedef struct {
+	void *shared;  /* arena that blocks are cached from */
+	size_t stacks; /* offset of magazines, ALLOCATOR_CACHE_DEPTH pointers per class */
+	size_t depth[ALLOCATOR_CACHE_CLASSES]; /* blocks in each magazine */
+	size_t used;   /* bytes handed out, rounded up to their class */
+} cache_t;
+
+/* An arena can be owned by a thread with 'allocator_set_owner', only the
+ * owner may then allocate from it, but any thread may free into it. Frees
+ * from other threads are pushed onto a lock-free list stored in the freed
+ * blocks themselves, which the owner takes in one exchange and frees on its
+ * next call. As the whole list is taken at once ABA is not a problem. */
+typedef struct {
+	size_t next; /* offset from the arena header of next block, zero ends the list */
+	size_t size; /* 'oldsz' passed to the free */
+} remote_t;
+
+/* A multi arena splits its buffer into equally sized sub-arenas, each a
+ * complete thread safe arena made by 'allocator_format'. Each thread is
+ * given its own sub-arena, so threads mostly take different locks, and only
+ * when that is exhausted does it steal from the sub-arena with the largest
+ * free block, so memory is not stranded in idle sub-arenas. The sub-arena a
+ * pointer belongs to is found by division. Moving a block to another
+ * sub-arena on reallocation copies 'oldsz' bytes, so it must be correct. */
+typedef struct {
+	size_t count;  /* number of sub-arenas */
+	size_t stride; /* length of each sub-arena */
+} multi_t;
+
 typedef struct {
-	unsigned char *buf, *aligned, *arena;
+	size_t allocs, frees, reallocs; /* successful operations */
+	size_t peak; /* high water mark of bytes in use, updated on allocation */
+} counts_t;
+
+/* The header only stores offsets, the caller's buffer starts 'pad' bytes
+ * before the header and the arena starts 'base' bytes after it, so a buffer
+ * can be written out and mapped back in at a different address (see
+ * 'allocator_attach'). Fields that only make sense to the current process,
+ * the trace and record callbacks, the profiler, locks, the owner and a
+ * cache's shared arena, are reset when attaching. */
+#define ARENA_MAGIC             ((size_t)(0x4152454Eul ^ (sizeof (allocator_t) << 20) ^ ALLOCATOR_ALIGNMENT))
+
+typedef struct {
+	size_t magic; /* changes with the header layout and alignment */
+	size_t pad, base;
 	allocator_trace_fn trace;
 	void *trace_param;
+	allocator_record_fn record;
+	void *record_param;
+	struct profile *profile;
 	size_t buf_len, arena_len;
-	int error, type;
+	int error, type, flags;
+	int lock; /* serialises access to the list and buddy allocators */
 	size_t nofree;
+	list_t list;
+	pool_t pool;
+	buddy_t buddy;
+	cache_t cache;
+	multi_t multi;
+	counts_t counts;
+	uintptr_t owner;  /* identifier of owning thread, or zero if not owned */
+	size_t remote;    /* offset of blocks freed by threads other than the owner */
 } allocator_t;
 
 static inline void implication(const int p, const int q) {
@@ -36,17 +309,194 @@ static inline void implication(const int p, const int q) {
 	check((!p) || q);
 }
 
+static inline unsigned char *arena_mem(allocator_t *a) {
+	return (unsigned char*)a + a->base;
+}
+
+static inline unsigned char *arena_buf(allocator_t *a) {
+	return (unsigned char*)a - a->pad;
+}
+
+static inline uintptr_t page_down(uintptr_t u) {
+	return u & ~(uintptr_t)(ALLOCATOR_PAGE - 1u);
+}
+
+static inline uintptr_t page_up(uintptr_t u) {
+	return page_down(u + ALLOCATOR_PAGE - 1u);
+}
+
+/* Gives the pages wholly within 'lo' to 'hi' back to the operating system,
+ * which will fault in zeroed pages if they are touched again, so the caller
+ * must not have anything stored there. */
+static void arena_decommit(allocator_t *a, uintptr_t lo, uintptr_t hi) {
+	if (!(a->flags & ALLOCATOR_FLAG_RELEASE))
+		return;
+	lo = page_up(lo);
+	hi = page_down(hi);
+	if (hi <= lo || (hi - lo) < ALLOCATOR_RELEASE_MIN)
+		return;
+#if ALLOCATOR_MMAP && defined(MADV_DONTNEED)
+	(void)madvise((void*)lo, hi - lo, MADV_DONTNEED);
+#endif
+}
+
+/* If an arena is formatted with ALLOCATOR_FLAG_THREAD_SAFE then the bump
+ * pointer of the NO_FREE allocator is updated with compare-and-swap, each
+ * size class of the pool allocator has its own lock, and the list and buddy
+ * allocators have a single lock (as coalescing can touch blocks of any class),
+ * so calls on those are serialised, a multi arena spreads threads over several
+ * of them instead. Counters are updated atomically. Otherwise these functions
+ * are plain operations. A waiter spins with exponential backoff and then
+ * yields, so a holder that has been descheduled is not starved of the CPU. */
+static inline int threaded(allocator_t *a) {
+	return !!(a->flags & ALLOCATOR_FLAG_THREAD_SAFE);
+}
+
+static inline void cpu_relax(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_ia32_pause();
+#elif defined(__GNUC__) && defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static inline void lock_backoff(unsigned *spin) {
+	check(spin);
+	if (*spin <= LOCK_SPIN_MAX) {
+		for (unsigned i = 0; i < *spin; i++)
+			cpu_relax();
+		*spin <<= 1;
+		return;
+	}
+#if ALLOCATOR_YIELD
+	(void)sched_yield();
+#else
+	for (unsigned i = 0; i < LOCK_SPIN_MAX; i++)
+		cpu_relax();
+#endif
+}
+
+static inline void arena_lock(allocator_t *a, int *lock) {
+	check(lock);
+#if ALLOCATOR_ATOMICS
+	if (!threaded(a))
+		return;
+	unsigned spin = 1;
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+			lock_backoff(&spin);
+#else
+	UNUSED(a);
+#endif
+}
+
+static inline void arena_unlock(allocator_t *a, int *lock) {
+	check(lock);
+#if ALLOCATOR_ATOMICS
+	if (threaded(a))
+		__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+#else
+	UNUSED(a);
+#endif
+}
+
+static inline size_t atomic_get(allocator_t *a, size_t *u) {
+#if ALLOCATOR_ATOMICS
+	if (threaded(a))
+		return __atomic_load_n(u, __ATOMIC_ACQUIRE);
+#endif
+	UNUSED(a);
+	return *u;
+}
+
+static inline void atomic_set(allocator_t *a, size_t *u, size_t v) {
+#if ALLOCATOR_ATOMICS
+	if (threaded(a)) {
+		__atomic_store_n(u, v, __ATOMIC_RELEASE);
+		return;
+	}
+#endif
+	UNUSED(a);
+	*u = v;
+}
+
+static inline void atomic_add(allocator_t *a, size_t *u, size_t v) {
+#if ALLOCATOR_ATOMICS
+	if (threaded(a)) {
+		(void)__atomic_fetch_add(u, v, __ATOMIC_RELAXED);
+		return;
+	}
+#endif
+	UNUSED(a);
+	*u += v;
+}
+
+static inline void atomic_sub(allocator_t *a, size_t *u, size_t v) {
+#if ALLOCATOR_ATOMICS
+	if (threaded(a)) {
+		(void)__atomic_fetch_sub(u, v, __ATOMIC_RELAXED);
+		return;
+	}
+#endif
+	UNUSED(a);
+	*u -= v;
+}
+
+static inline void atomic_or(allocator_t *a, size_t *u, size_t v) {
+#if ALLOCATOR_ATOMICS
+	if (threaded(a)) {
+		(void)__atomic_fetch_or(u, v, __ATOMIC_RELAXED);
+		return;
+	}
+#endif
+	UNUSED(a);
+	*u |= v;
+}
+
+static inline void atomic_and(allocator_t *a, size_t *u, size_t v) {
+#if ALLOCATOR_ATOMICS
+	if (threaded(a)) {
+		(void)__atomic_fetch_and(u, v, __ATOMIC_RELAXED);
+		return;
+	}
+#endif
+	UNUSED(a);
+	*u &= v;
+}
+
+/* Returns non-zero and sets '*u' to 'desired' if '*u' was 'expected' */
+static inline int atomic_cas(allocator_t *a, size_t *u, size_t expected, size_t desired) {
+#if ALLOCATOR_ATOMICS
+	if (threaded(a))
+		return __atomic_compare_exchange_n(u, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+	UNUSED(a);
+	if (*u != expected)
+		return 0;
+	*u = desired;
+	return 1;
+}
+
+static inline void atomic_max(allocator_t *a, size_t *u, size_t v) {
+	for (size_t old = atomic_get(a, u); old < v; old = atomic_get(a, u))
+		if (atomic_cas(a, u, old, v))
+			break;
+}
+
 static void arena_validate(void *arena) {
 	check(arena);
 	allocator_t *a = arena;
-	check(a->buf);
-	check(a->aligned);
+	check(a->magic == ARENA_MAGIC);
 	check(a->buf_len >= ((sizeof (*a) + ALLOCATOR_ALIGNMENT) * 2ull));
-	check(a->nofree <= a->arena_len);
+	check(atomic_get(a, &a->nofree) <= a->arena_len);
 	switch (a->type) {
 	case ALLOCATOR_TYPE_LIST:
 	case ALLOCATOR_TYPE_NO_FREE:
 	case ALLOCATOR_TYPE_FAIL:
+	case ALLOCATOR_TYPE_POOL:
+	case ALLOCATOR_TYPE_CACHE:
+	case ALLOCATOR_TYPE_MULTI:
+	case ALLOCATOR_TYPE_BUDDY:
 		break;
 	default: check(0);
 	}
@@ -56,6 +506,82 @@ static uintptr_t alignup(uintptr_t u) {
 	return (u & ~ALIGN_MASK) + (ALLOCATOR_ALIGNMENT & (uintptr_t)((intptr_t)(-!!(u & ALIGN_MASK))));
 }
 
+static inline uintptr_t thread_id(void) { /* unique non-zero value per thread */
+#if ALLOCATOR_ATOMICS
+	static __thread char token;
+	return (uintptr_t)&token;
+#else
+	return 1;
+#endif
+}
+
+static inline size_t thread_slot(void) { /* small number per thread, handed out in order */
+#if ALLOCATOR_ATOMICS
+	static size_t next;
+	static __thread size_t slot;
+	if (!slot)
+		slot = __atomic_add_fetch(&next, 1, __ATOMIC_RELAXED);
+	return slot - 1;
+#else
+	return 0;
+#endif
+}
+
+static inline remote_t *remote_at(allocator_t *a, size_t off) {
+	return off ? (remote_t*)((uintptr_t)a + off) : NULL;
+}
+
+static void remote_push(allocator_t *a, void *ptr, size_t oldsz) {
+	check(ptr);
+	remote_t *r = ptr;
+	const size_t off = (uintptr_t)ptr - (uintptr_t)a;
+	r->size = oldsz;
+#if ALLOCATOR_ATOMICS
+	r->next = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&a->remote, &r->next, off, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+#else
+	r->next = a->remote;
+	a->remote = off;
+#endif
+}
+
+static remote_t *remote_take(allocator_t *a) {
+#if ALLOCATOR_ATOMICS
+	if (!__atomic_load_n(&a->remote, __ATOMIC_RELAXED))
+		return NULL;
+	return remote_at(a, __atomic_exchange_n(&a->remote, 0, __ATOMIC_ACQUIRE));
+#else
+	const size_t off = a->remote;
+	a->remote = 0;
+	return remote_at(a, off);
+#endif
+}
+
+static inline unsigned bit_ffs(size_t u) { /* index of lowest set bit, 'u' must not be zero */
+	check(u);
+#ifdef __GNUC__
+	return __builtin_ctzll(u);
+#else
+	unsigned r = 0;
+	for (; !(u & 1u); u >>= 1)
+		r++;
+	return r;
+#endif
+}
+
+static inline unsigned bit_fls(size_t u) { /* index of highest set bit, 'u' must not be zero */
+	check(u);
+#ifdef __GNUC__
+	return (sizeof (unsigned long long) * CHAR_BIT) - 1u - __builtin_clzll(u);
+#else
+	unsigned r = 0;
+	for (; u >>= 1;)
+		r++;
+	return r;
+#endif
+}
+
 static int alogger(void *arena, int fatal, const char *func, int line, const char *fmt, ...) {
 	check(arena);
 	check(fmt);
@@ -65,8 +591,8 @@ static int alogger(void *arena, int fatal, const char *func, int line, const cha
 	if (fatal)
 		a->error = -line;
 	if (a->trace == NULL)
-		return 0;
-	/* TODO: Trace fatal/func/line */
+		return fatal ? -1 : 0;
+	UNUSED(func); /* TODO: Trace fatal/func/line */
 	va_list ap;
 	va_start(ap, fmt);
 	const int r1 = a->trace(a->trace_param, fmt, ap);
@@ -82,176 +608,3257 @@ fail:
 #define alog(ARENA, FMT, ...) alogger((ARENA), 0, __func__, __LINE__, (FMT), ##__VA_ARGS__)
 #define adie(ARENA, FMT, ...) alogger((ARENA), 1, __func__, __LINE__, (FMT), ##__VA_ARGS__)
 
-int allocator_format(void **arena, int type, unsigned char *buf, size_t len) {
-	check(arena);
-	check(buf);
-	*arena = NULL;
-	memset(buf, 0, len);
-	unsigned char *aligned = (unsigned char*)alignup((uintptr_t)buf);
-	type = type == ALLOCATOR_TYPE_DEFAULT ? ALLOCATOR_TYPE_LIST : type;
-	allocator_t a = {
-		.trace = NULL,
-		.buf = buf,
-		.buf_len = len,
-		.aligned = aligned,
-		.error = 0,
-		.type = type,
-	};
-	switch (type) {
-	case ALLOCATOR_TYPE_LIST:
-	case ALLOCATOR_TYPE_NO_FREE:
-	case ALLOCATOR_TYPE_FAIL:
-		break;
-	default:
-		return -1;
+static inline lblock_t *list_block(allocator_t *a, size_t off) {
+	check(off >= a->list.start && off <= a->list.end);
+	return (lblock_t*)&arena_mem(a)[off];
+}
+
+static inline lfree_t *list_links(allocator_t *a, size_t off) {
+	return (lfree_t*)&arena_mem(a)[off + LIST_HDR];
+}
+
+static inline size_t list_size(lblock_t *b) {
+	return b->size & ~(size_t)LIST_FLAGS;
+}
+
+static inline size_t *list_head(allocator_t *a, size_t fl, size_t sl) {
+	check(fl < a->list.fl_count && sl < LIST_SL_COUNT);
+	return &((size_t*)&arena_mem(a)[a->list.heads])[(fl * LIST_SL_COUNT) + sl];
+}
+
+static inline size_t *list_sl_map(allocator_t *a, size_t fl) {
+	check(fl < a->list.fl_count);
+	return &((size_t*)&arena_mem(a)[a->list.sl_map])[fl];
+}
+
+static void list_mapping(size_t size, size_t *fl, size_t *sl) {
+	check(fl);
+	check(sl);
+	if (size < LIST_SMALL) {
+		*fl = 0;
+		*sl = size / ALLOCATOR_ALIGNMENT;
+		return;
 	}
+	const unsigned l = bit_fls(size);
+	*fl = l - bit_fls(LIST_SMALL) + 1u;
+	*sl = (size >> (l - LIST_SL_LOG2)) ^ LIST_SL_COUNT;
+}
 
-	if (len < ((sizeof (a) + ALLOCATOR_ALIGNMENT) * 2ull))
-		return -1;
-	a.arena = (unsigned char*)alignup((uintptr_t)aligned + sizeof (a));
-	a.arena_len = (buf + len) - a.arena;
-	memcpy(aligned, &a, sizeof a);
-	*arena = (void*)aligned;
-	return 0;
+static void list_insert(allocator_t *a, size_t off) {
+	lblock_t *b = list_block(a, off);
+	size_t fl = 0, sl = 0;
+	list_mapping(list_size(b), &fl, &sl);
+	size_t *head = list_head(a, fl, sl);
+	lfree_t *l = list_links(a, off);
+	l->prev = 0;
+	l->next = *head;
+	if (*head)
+		list_links(a, *head)->prev = off;
+	*head = off;
+	*list_sl_map(a, fl) |= (size_t)1 << sl;
+	a->list.fl_map |= (size_t)1 << fl;
+	a->list.free += list_size(b);
 }
 
-int allocator_reformat(void *arena, int type) {
-	arena_validate(arena);
-	allocator_t *a = arena;
-	void *newarena = arena;
-	const int r = allocator_format(&newarena, type, a->buf, a->buf_len);
-	implies(r >= 0, newarena == arena);
-	return r;
+static void list_remove(allocator_t *a, size_t off) {
+	lblock_t *b = list_block(a, off);
+	check(b->size & LIST_FREE);
+	size_t fl = 0, sl = 0;
+	list_mapping(list_size(b), &fl, &sl);
+	lfree_t *l = list_links(a, off);
+	check(a->list.free >= list_size(b));
+	a->list.free -= list_size(b);
+	if (l->next)
+		list_links(a, l->next)->prev = l->prev;
+	if (l->prev) {
+		list_links(a, l->prev)->next = l->next;
+		return;
+	}
+	size_t *head = list_head(a, fl, sl);
+	check(*head == off);
+	*head = l->next;
+	if (*head)
+		return;
+	size_t *slm = list_sl_map(a, fl);
+	*slm &= ~((size_t)1 << sl);
+	if (*slm == 0)
+		a->list.fl_map &= ~((size_t)1 << fl);
 }
 
-int allocator_is_ptr_valid(void *arena, void *ptr) {
-	arena_validate(arena);
-	allocator_t *a = arena;
-	if (a->error < 0)
-		return a->error;
-	unsigned char *end = a->arena + a->arena_len, *p = ptr;
-	if (p < a->arena || p > end)
+/* Find the first free block in a class at least as large as the class 'size'
+ * would be rounded up to, as every block in such a class is big enough to
+ * satisfy the request no searching within a free list is required. */
+static size_t list_find(allocator_t *a, size_t size) {
+	if (size >= LIST_SMALL)
+		size += ((size_t)1 << (bit_fls(size) - LIST_SL_LOG2)) - 1u;
+	size_t fl = 0, sl = 0;
+	list_mapping(size, &fl, &sl);
+	if (fl >= a->list.fl_count)
 		return 0;
-	switch (a->type) {
-	case ALLOCATOR_TYPE_LIST:
-	case ALLOCATOR_TYPE_NO_FREE:
-	case ALLOCATOR_TYPE_FAIL:
-	default:
-		return -1;
+	size_t slm = *list_sl_map(a, fl) & (~(size_t)0 << sl);
+	if (!slm) {
+		const size_t flm = (fl + 1u) < (sizeof (size_t) * CHAR_BIT) ? a->list.fl_map & (~(size_t)0 << (fl + 1u)) : 0;
+		if (!flm)
+			return 0;
+		fl = bit_ffs(flm);
+		slm = *list_sl_map(a, fl);
 	}
-
-	return 1;
+	check(slm);
+	return *list_head(a, fl, bit_ffs(slm));
 }
 
-int allocator_is_ptr_allocated(void *arena, void *ptr) {
-	arena_validate(arena);
-	allocator_t *a = arena;
-	if (a->error < 0)
-		return a->error;
-	const int valid = allocator_is_ptr_valid(arena, ptr);
-	if (valid < 0)
-		return -1;
-	if (valid == 0)
+/* The largest allocation guaranteed to succeed is determined by the lower
+ * bound of the largest non-empty class, as 'list_find' will not look at a
+ * class unless all of its blocks fit. */
+static size_t list_largest(allocator_t *a) {
+	if (!a->list.fl_map)
 		return 0;
+	const size_t fl = bit_fls(a->list.fl_map), sl = bit_fls(*list_sl_map(a, fl));
+	size_t size = sl * ALLOCATOR_ALIGNMENT;
+	if (fl) {
+		const unsigned l = fl + bit_fls(LIST_SMALL) - 1u;
+		size = ((size_t)1 << l) + (sl << (l - LIST_SL_LOG2));
+	}
+	return size > LIST_HDR ? size - LIST_HDR : 0;
+}
 
-	return 1;
+/* Mark the (possibly merged) block at 'off' as free and tell its neighbour */
+static void list_release(allocator_t *a, size_t off) {
+	lblock_t *b = list_block(a, off);
+	b->size |= LIST_FREE;
+	lblock_t *n = list_block(a, off + list_size(b));
+	n->size |= LIST_PREV_FREE;
+	n->prev = off;
+	list_insert(a, off);
 }
 
-int allocator_get_max_allocatable(void *arena, size_t *size) {
-	arena_validate(arena);
-	check(size);
-	allocator_t *a = arena;
-	if (a->error < 0)
-		return a->error;
-	*size = 0;
-	switch (a->type) {
-	case ALLOCATOR_TYPE_NO_FREE: *size = a->arena_len - a->nofree; return 0;
-	case ALLOCATOR_TYPE_FAIL:  return 0;
-	case ALLOCATOR_TYPE_LIST: break;
+/* Split 'size' bytes off the front of a used block, freeing the remainder */
+static void list_split(allocator_t *a, size_t off, size_t size) {
+	lblock_t *b = list_block(a, off);
+	check(!(b->size & LIST_FREE));
+	const size_t bsz = list_size(b);
+	check(bsz >= size);
+	if ((bsz - size) < LIST_MIN)
+		return;
+	b->size = size | (b->size & LIST_FLAGS);
+	const size_t roff = off + size;
+	lblock_t *r = list_block(a, roff);
+	r->prev = off;
+	r->size = bsz - size;
+	lblock_t *n = list_block(a, roff + r->size);
+	if (n->size & LIST_FREE) { /* coalesce with next block */
+		list_remove(a, roff + r->size);
+		r->size += list_size(n);
 	}
-	return -1;
+	list_release(a, roff);
 }
 
-int allocator_get_overhead(void *arena, size_t *size) {
-	arena_validate(arena);
-	check(size);
-	allocator_t *a = arena;
-	if (a->error < 0)
-		return a->error;
-	*size = 0;
-	return -1;
+static size_t list_adjust(size_t n) {
+	const size_t size = alignup(n + LIST_HDR);
+	return size < LIST_MIN ? LIST_MIN : size;
 }
 
-int allocator_get_free(void *arena, size_t *size) {
-	arena_validate(arena);
-	check(size);
-	allocator_t *a = arena;
-	if (a->error < 0)
-		return a->error;
-	*size = 0;
-	return -1;
+static void *list_malloc(allocator_t *a, size_t n) {
+	if (n > a->arena_len)
+		return NULL;
+	const size_t size = list_adjust(n);
+	const size_t off = list_find(a, size);
+	if (!off)
+		return NULL;
+	list_remove(a, off);
+	lblock_t *b = list_block(a, off);
+	b->size &= ~(size_t)LIST_FREE;
+	list_block(a, off + list_size(b))->size &= ~(size_t)LIST_PREV_FREE;
+	list_split(a, off, size);
+	return &arena_mem(a)[off + LIST_HDR];
 }
 
-int allocator_get_total(void *arena, size_t *size) {
-	arena_validate(arena);
-	check(size);
-	allocator_t *a = arena;
-	if (a->error < 0)
-		return a->error;
-	*size = 0;
-	return -1;
+/* An aligned block is carved from a free block with room for a free block
+ * in front of the aligned payload, that gap is given back so only the usual
+ * rounding is lost rather than a whole alignment per block. */
+static void *list_aligned(allocator_t *a, size_t n, size_t align) {
+	if (n > a->arena_len || align > a->arena_len)
+		return NULL;
+	const size_t size = list_adjust(n);
+	size_t off = list_find(a, size + align + LIST_MIN);
+	if (!off)
+		return NULL;
+	list_remove(a, off);
+	lblock_t *b = list_block(a, off);
+	b->size &= ~(size_t)LIST_FREE;
+	list_block(a, off + list_size(b))->size &= ~(size_t)LIST_PREV_FREE;
+	const uintptr_t p = (uintptr_t)&arena_mem(a)[off + LIST_HDR];
+	size_t gap = ((p + align - 1u) & ~(uintptr_t)(align - 1u)) - p;
+	if (gap && gap < LIST_MIN)
+		gap += align;
+	if (gap) {
+		const size_t noff = off + gap;
+		lblock_t *r = list_block(a, noff);
+		r->prev = off;
+		r->size = list_size(b) - gap;
+		list_block(a, noff + r->size)->prev = noff;
+		b->size = gap | (b->size & LIST_PREV_FREE);
+		list_release(a, off);
+		off = noff;
+	}
+	list_split(a, off, size);
+	return &arena_mem(a)[off + LIST_HDR];
 }
 
-int allocator_set_trace(void *arena, allocator_trace_fn trace, void *param) {
-	arena_validate(arena);
-	allocator_t *a = arena;
-	if (a->error < 0)
-		return a->error;
-	a->trace = trace;
-	a->trace_param = param;
+static size_t list_offset(allocator_t *a, void *ptr) { /* returns zero on invalid pointer */
+	unsigned char *p = ptr;
+	if (p < &arena_mem(a)[a->list.start + LIST_HDR] || p >= &arena_mem(a)[a->list.end])
+		return 0;
+	const size_t off = (p - arena_mem(a)) - LIST_HDR;
+	if (off & ALIGN_MASK)
+		return 0;
+	if (list_block(a, off)->size & LIST_FREE)
+		return 0;
+	return off;
+}
+
+static int list_free(allocator_t *a, void *ptr) {
+	size_t off = list_offset(a, ptr);
+	if (!off)
+		return adie(a, "invalid free %p", ptr);
+	lblock_t *b = list_block(a, off);
+	const size_t freed = off, freed_end = off + list_size(b);
+	if (b->size & LIST_PREV_FREE) {
+		const size_t poff = b->prev;
+		lblock_t *p = list_block(a, poff);
+		list_remove(a, poff);
+		p->size += list_size(b);
+		off = poff;
+		b = p;
+	}
+	lblock_t *n = list_block(a, off + list_size(b));
+	if (n->size & LIST_FREE) {
+		list_remove(a, off + list_size(b));
+		b->size += list_size(n);
+	}
+	list_release(a, off);
+	if (a->flags & ALLOCATOR_FLAG_RELEASE) { /* only pages this free emptied, the links must stay */
+		const uintptr_t m = (uintptr_t)arena_mem(a);
+		const uintptr_t keep = m + off + LIST_MIN, lo = page_down(m + freed);
+		const uintptr_t end = m + off + list_size(b), hi = page_up(m + freed_end);
+		arena_decommit(a, lo > keep ? lo : keep, hi < end ? hi : end);
+	}
 	return 0;
 }
 
-void *allocator(void *arena, void *ptr, size_t oldsz, size_t newsz) {
-	arena_validate(arena);
-	allocator_t *a = arena;
-	if (a->error < 0)
+/* Reallocation attempts to resize the block in place before falling back to
+ * allocate-copy-free; shrinking gives the tail back, growing absorbs the next
+ * physical block if it is free, and failing that the previous block if it is
+ * free (which requires a move, but not extra memory). */
+static void *list_realloc(allocator_t *a, void *ptr, size_t newsz) {
+	const size_t off = list_offset(a, ptr);
+	if (!off) {
+		(void)adie(a, "invalid realloc %p", ptr);
 		return NULL;
+	}
+	if (newsz > a->arena_len)
+		return NULL;
+	const size_t size = list_adjust(newsz);
+	lblock_t *b = list_block(a, off);
+	const size_t bsz = list_size(b);
+	if (size <= bsz) {
+		list_split(a, off, size);
+		return ptr;
+	}
+	const size_t noff = off + bsz;
+	lblock_t *n = list_block(a, noff);
+	const size_t nsz = (n->size & LIST_FREE) ? list_size(n) : 0;
+	if ((bsz + nsz) >= size) {
+		list_remove(a, noff);
+		b->size += nsz;
+		lblock_t *e = list_block(a, off + list_size(b));
+		e->size &= ~(size_t)LIST_PREV_FREE;
+		e->prev = off;
+		list_split(a, off, size);
+		return ptr;
+	}
+	if (b->size & LIST_PREV_FREE) {
+		const size_t poff = b->prev;
+		lblock_t *p = list_block(a, poff);
+		const size_t psz = list_size(p);
+		if ((psz + bsz + nsz) >= size) {
+			list_remove(a, poff);
+			if (nsz)
+				list_remove(a, noff);
+			p->size = (psz + bsz + nsz) | (p->size & LIST_PREV_FREE);
+			lblock_t *e = list_block(a, poff + list_size(p));
+			e->size &= ~(size_t)LIST_PREV_FREE;
+			e->prev = poff;
+			unsigned char *r = &arena_mem(a)[poff + LIST_HDR];
+			memmove(r, ptr, bsz - LIST_HDR);
+			list_split(a, poff, size);
+			return r;
+		}
+	}
+	void *r = list_malloc(a, newsz);
+	if (!r)
+		return NULL;
+	memcpy(r, ptr, bsz - LIST_HDR);
+	(void)list_free(a, ptr);
+	return r;
+}
 
-	switch (a->type) {
-	case ALLOCATOR_TYPE_NO_FREE: {
-		if (newsz == 0)
+static inline slab_t *slab_at(allocator_t *a, size_t off) {
+	return (slab_t*)&arena_mem(a)[off];
+}
+
+static inline size_t slab_class(size_t n) {
+	check(n && n <= ALLOCATOR_SLAB_MAX);
+	return (n - 1u) / ALLOCATOR_ALIGNMENT;
+}
+
+static inline size_t slab_count(slab_t *s) {
+	return (ALLOCATOR_SLAB_SIZE - SLAB_HDR) / s->size;
+}
+
+static void slab_push(allocator_t *a, size_t cls, size_t off) {
+	slab_t *s = slab_at(a, off);
+	s->prev = 0;
+	s->next = a->list.slabs[cls];
+	if (s->next)
+		slab_at(a, s->next)->prev = off;
+	a->list.slabs[cls] = off;
+}
+
+static void slab_unlink(allocator_t *a, size_t cls, size_t off) {
+	slab_t *s = slab_at(a, off);
+	if (s->next)
+		slab_at(a, s->next)->prev = s->prev;
+	if (s->prev)
+		slab_at(a, s->prev)->next = s->next;
+	else
+		a->list.slabs[cls] = s->next;
+}
+
+static void *slab_malloc(allocator_t *a, size_t n) {
+	const size_t cls = slab_class(n);
+	size_t off = a->list.slabs[cls];
+	if (!off) {
+		unsigned char *m = list_aligned(a, ALLOCATOR_SLAB_SIZE, ALLOCATOR_SLAB_SIZE);
+		if (!m)
 			return NULL;
-		if (newsz <= oldsz)
-			return ptr;
-		if (ptr) {
-			if (oldsz == 0) /* no frees allowed */
+		off = m - arena_mem(a);
+		slab_t *s = slab_at(a, off);
+		memset(s, 0, sizeof (*s));
+		s->magic = SLAB_MAGIC;
+		s->size = (cls + 1u) * ALLOCATOR_ALIGNMENT;
+		a->list.slab_bytes += list_size(list_block(a, off - LIST_HDR));
+		slab_push(a, cls, off);
+	}
+	slab_t *s = slab_at(a, off);
+	size_t slot = 0;
+	for (size_t i = 0; i < SLAB_UNITS; i++) {
+		if (s->map[i] == ~(size_t)0)
+			continue;
+		slot = (i * POOL_BITS) + bit_ffs(~s->map[i]);
+		break;
+	}
+	check(slot < slab_count(s));
+	s->map[slot / POOL_BITS] |= (size_t)1 << (slot % POOL_BITS);
+	if (++s->used == slab_count(s))
+		slab_unlink(a, cls, off);
+	a->list.sized++;
+	a->list.slab_used += s->size;
+	return &arena_mem(a)[off + SLAB_HDR + (slot * s->size)];
+}
+
+static int slab_free(allocator_t *a, void *ptr, size_t oldsz) {
+	const size_t cls = slab_class(oldsz);
+	const uintptr_t p = (uintptr_t)ptr, base = p & ~(uintptr_t)(ALLOCATOR_SLAB_SIZE - 1u);
+	const size_t off = base - (uintptr_t)arena_mem(a);
+	slab_t *s = (slab_t*)base;
+#if ALLOCATOR_VERIFY_SIZE
+	if (base < (uintptr_t)&arena_mem(a)[a->list.start] || base >= (uintptr_t)&arena_mem(a)[a->list.end])
+		return adie(a, "invalid free %p", ptr);
+	if (s->magic != SLAB_MAGIC || s->size != ((cls + 1u) * ALLOCATOR_ALIGNMENT))
+		return adie(a, "invalid size %zu for %p", oldsz, ptr);
+	if ((p - base) < SLAB_HDR || ((p - base - SLAB_HDR) % s->size) || ((p - base - SLAB_HDR) / s->size) >= slab_count(s))
+		return adie(a, "invalid free %p", ptr);
+#endif
+	const size_t slot = (p - base - SLAB_HDR) / s->size, bit = (size_t)1 << (slot % POOL_BITS);
+#if ALLOCATOR_VERIFY_SIZE
+	if (!(s->map[slot / POOL_BITS] & bit))
+		return adie(a, "double free %p", ptr);
+#endif
+	if (s->used == slab_count(s))
+		slab_push(a, cls, off);
+	s->map[slot / POOL_BITS] &= ~bit;
+	s->used--;
+	a->list.sized--;
+	a->list.slab_used -= s->size;
+	if (s->used || (a->list.slabs[cls] == off && !s->next)) /* keep the last slab */
+		return 0;
+	slab_unlink(a, cls, off);
+	a->list.slab_bytes -= list_size(list_block(a, off - LIST_HDR));
+	s->magic = 0;
+	return list_free(a, s);
+}
+
+/* Objects stay in slabs if and only if they are no bigger than
+ * ALLOCATOR_SLAB_MAX, moving between slabs and list blocks as they are
+ * resized, so the size passed in always says where an object is. */
+static void *slab_allocator(allocator_t *a, void *ptr, size_t oldsz, size_t newsz) {
+	if (ptr && oldsz == 0) {
+		(void)adie(a, "size needed for %p", ptr);
+		return NULL;
+	}
+	const int small_old = ptr && oldsz <= ALLOCATOR_SLAB_MAX, small_new = newsz && newsz <= ALLOCATOR_SLAB_MAX;
+	if (ptr == NULL)
+		return newsz ? (small_new ? slab_malloc(a, newsz) : list_malloc(a, newsz)) : NULL;
+	if (newsz == 0) {
+		(void)(small_old ? slab_free(a, ptr, oldsz) : list_free(a, ptr));
+		return NULL;
+	}
+	if (!small_old && !small_new)
+		return list_realloc(a, ptr, newsz);
+	if (small_old && small_new && slab_class(oldsz) == slab_class(newsz))
+		return ptr;
+	void *r = small_new ? slab_malloc(a, newsz) : list_malloc(a, newsz);
+	if (!r)
+		return NULL;
+	memcpy(r, ptr, oldsz < newsz ? oldsz : newsz);
+	(void)(small_old ? slab_free(a, ptr, oldsz) : list_free(a, ptr));
+	return r;
+}
+
+static void *list_allocator(allocator_t *a, void *ptr, size_t oldsz, size_t newsz) {
+	if (a->flags & ALLOCATOR_FLAG_SIZED)
+		return slab_allocator(a, ptr, oldsz, newsz);
+	if (newsz == 0) {
+		if (ptr)
+			(void)list_free(a, ptr);
+		return NULL;
+	}
+	if (ptr == NULL)
+		return list_malloc(a, newsz);
+	return list_realloc(a, ptr, newsz);
+}
+
+/* The most recent allocation in a NO_FREE arena sits on top of the bump
+ * pointer, and can be resized in place or released by moving it. As the
+ * bump pointer is only aligned when allocating, the previous allocation
+ * becomes the top one again once the most recent one is released. */
+static inline int nofree_is_top(allocator_t *a, size_t top, void *ptr, size_t oldsz) {
+	unsigned char *p = ptr;
+	if (!p || p < arena_mem(a) || p > &arena_mem(a)[top])
+		return 0;
+	const size_t off = p - arena_mem(a);
+	if (oldsz > (top - off))
+		return 0;
+	return alignup(off + oldsz) == alignup(top);
+}
+
+/* The new bump pointer is computed from a snapshot of the old one and only
+ * committed if it has not changed in the meantime, so concurrent callers
+ * never need a lock. */
+static inline void *nofree_allocator(allocator_t *a, void *ptr, size_t oldsz, size_t newsz) {
+	if (ptr && oldsz == 0) /* size of old allocation is needed */
+		return NULL;
+	for (;;) {
+		const size_t top = atomic_get(a, &a->nofree);
+		size_t off = 0;
+		void *r = NULL;
+		if (nofree_is_top(a, top, ptr, oldsz)) {
+			off = (unsigned char*)ptr - arena_mem(a);
+			if (newsz > (a->arena_len - off))
+				return NULL;
+			r = newsz ? ptr : NULL;
+		} else {
+			if (newsz == 0) /* only the top allocation can be freed */
+				return NULL;
+			if (newsz <= oldsz)
+				return ptr;
+			off = alignup(top);
+			if (off > a->arena_len || newsz > (a->arena_len - off))
 				return NULL;
+			r = &arena_mem(a)[off];
+		}
+		if (!atomic_cas(a, &a->nofree, top, off + newsz))
+			continue;
+		if (ptr && r && r != ptr)
+			memcpy(r, ptr, oldsz);
+		return r;
+	}
+}
+
+static int nofree_free(allocator_t *a, void *ptr, size_t oldsz) {
+	for (;;) {
+		const size_t top = atomic_get(a, &a->nofree);
+		if (oldsz == 0 || !nofree_is_top(a, top, ptr, oldsz))
+			return -1;
+		if (atomic_cas(a, &a->nofree, top, (unsigned char*)ptr - arena_mem(a)))
+			return 0;
+	}
+}
+
+static void *nofree_aligned(allocator_t *a, size_t n, size_t align) {
+	for (;;) {
+		const size_t top = atomic_get(a, &a->nofree);
+		const uintptr_t p = (uintptr_t)&arena_mem(a)[top];
+		const size_t off = top + (((p + align - 1u) & ~(uintptr_t)(align - 1u)) - p);
+		if (off > a->arena_len || n > (a->arena_len - off))
+			return NULL;
+		if (atomic_cas(a, &a->nofree, top, off + n))
+			return &arena_mem(a)[off];
+	}
+}
+
+static int list_format(allocator_t *a) {
+	check(a);
+	list_t *l = &a->list;
+	if (a->arena_len < (LIST_SMALL * 2u))
+		return -1;
+	size_t fl = 0, sl = 0;
+	list_mapping(a->arena_len, &fl, &sl);
+	l->fl_map = 0;
+	l->free = 0;
+	memset(l->slabs, 0, sizeof (l->slabs));
+	l->sized = 0;
+	l->slab_bytes = 0;
+	l->slab_used = 0;
+	l->phase = (uintptr_t)arena_mem(a) % ALLOCATOR_SLAB_SIZE;
+	l->fl_count = fl + 1u;
+	if (l->fl_count > (sizeof (size_t) * CHAR_BIT))
+		return -1;
+	l->sl_map = alignup(1); /* offset zero is reserved as the NULL offset */
+	l->heads = l->sl_map + (l->fl_count * sizeof (size_t));
+	l->start = alignup(l->heads + (l->fl_count * LIST_SL_COUNT * sizeof (size_t)));
+	l->end = (a->arena_len - LIST_HDR) & ~ALIGN_MASK;
+	if (l->end < l->start || (l->end - l->start) < LIST_MIN)
+		return -1;
+	memset(&arena_mem(a)[l->sl_map], 0, l->start - l->sl_map);
+	lblock_t *b = (lblock_t*)&arena_mem(a)[l->start], *e = (lblock_t*)&arena_mem(a)[l->end];
+	b->prev = 0;
+	b->size = l->end - l->start;
+	e->prev = l->start;
+	e->size = LIST_HDR;
+	list_release(a, l->start);
+	return 0;
+}
+
+static inline size_t pool_class_size(size_t cls) {
+	return POOL_MIN << cls;
+}
+
+static inline size_t pool_class(size_t n) { /* smallest class 'n' fits in, may be out of range */
+	if (n <= POOL_MIN)
+		return 0;
+	return bit_fls(n - 1u) + 1u - bit_fls(POOL_MIN);
+}
+
+static inline size_t *pool_map(allocator_t *a, pclass_t *c) {
+	return (size_t*)&arena_mem(a)[c->map];
+}
+
+static void *pool_class_malloc(allocator_t *a, size_t cls) {
+	pclass_t *c = &a->pool.classes[cls];
+	size_t *map = pool_map(a, c);
+	arena_lock(a, &c->lock);
+	const size_t units = (c->count + POOL_BITS - 1u) / POOL_BITS;
+	for (size_t n = 0, i = c->hint; n < units; n++, i = (i + 1u) == units ? 0 : i + 1u) {
+		if (map[i] == ~(size_t)0)
+			continue;
+		const size_t bit = bit_ffs(~map[i]), block = (i * POOL_BITS) + bit;
+		if (block >= c->count) /* bits past the end are never set */
+			continue;
+		atomic_or(a, &map[i], (size_t)1 << bit); /* atomic as 'pool_locate' does not lock */
+		c->hint = i;
+		arena_unlock(a, &c->lock);
+		const size_t size = pool_class_size(cls);
+		atomic_add(a, &a->pool.used, size);
+		atomic_sub(a, &a->pool.free, size);
+		return &arena_mem(a)[c->blocks + (block * size)];
+	}
+	atomic_and(a, &a->pool.avail, ~((size_t)1 << cls));
+	arena_unlock(a, &c->lock);
+	return NULL;
+}
+
+/* Requests are served from the smallest class they fit in, spilling into
+ * larger classes if that class is exhausted. */
+static void *pool_malloc(allocator_t *a, size_t n) {
+	for (size_t cls = pool_class(n); cls < ALLOCATOR_POOL_CLASSES; cls++) {
+		if (!(atomic_get(a, &a->pool.avail) & ((size_t)1 << cls)))
+			continue;
+		void *r = pool_class_malloc(a, cls);
+		if (r)
+			return r;
+	}
+	return NULL;
+}
+
+/* Find the class and block index of a block, returning -1 if 'ptr' is not
+ * the start of one or else its ALLOCATOR_WALK_ state */
+static int pool_state(allocator_t *a, void *ptr, size_t *cls, size_t *block) {
+	check(cls);
+	check(block);
+	unsigned char *p = ptr;
+	if (p < &arena_mem(a)[a->pool.start])
+		return -1;
+	const size_t off = p - arena_mem(a), region = (off - a->pool.start) / a->pool.region;
+	if (region >= ALLOCATOR_POOL_CLASSES)
+		return -1;
+	pclass_t *c = &a->pool.classes[region];
+	const size_t size = pool_class_size(region);
+	if (off < c->blocks || ((off - c->blocks) % size))
+		return -1;
+	const size_t b = (off - c->blocks) / size;
+	if (b >= c->count)
+		return -1;
+	*cls = region;
+	*block = b;
+	return (atomic_get(a, &pool_map(a, c)[b / POOL_BITS]) & ((size_t)1 << (b % POOL_BITS))) ? ALLOCATOR_WALK_USED : ALLOCATOR_WALK_FREE;
+}
+
+/* Find the class and block index of an allocated pointer, or return -1 */
+static int pool_locate(allocator_t *a, void *ptr, size_t *cls, size_t *block) {
+	return pool_state(a, ptr, cls, block) == ALLOCATOR_WALK_USED ? 0 : -1;
+}
 
+static int pool_free(allocator_t *a, void *ptr) {
+	size_t cls = 0, block = 0;
+	if (pool_locate(a, ptr, &cls, &block) < 0)
+		return adie(a, "invalid free %p", ptr);
+	pclass_t *c = &a->pool.classes[cls];
+	arena_lock(a, &c->lock);
+	atomic_and(a, &pool_map(a, c)[block / POOL_BITS], ~((size_t)1 << (block % POOL_BITS)));
+	c->hint = block / POOL_BITS;
+	atomic_or(a, &a->pool.avail, (size_t)1 << cls);
+	arena_unlock(a, &c->lock);
+	atomic_sub(a, &a->pool.used, pool_class_size(cls));
+	atomic_add(a, &a->pool.free, pool_class_size(cls));
+	return 0;
+}
+
+/* Batches claim every free block they need from a bitmap unit with a single
+ * write, and take each class lock once. */
+static size_t pool_class_batch(allocator_t *a, size_t cls, void **ptrs, size_t count) {
+	pclass_t *c = &a->pool.classes[cls];
+	size_t *map = pool_map(a, c), n = 0;
+	const size_t size = pool_class_size(cls);
+	arena_lock(a, &c->lock);
+	const size_t units = (c->count + POOL_BITS - 1u) / POOL_BITS;
+	for (size_t u = 0, i = c->hint; u < units && n < count; u++, i = (i + 1u) == units ? 0 : i + 1u) {
+		size_t avail = ~map[i], take = 0;
+		if ((i + 1u) == units && (c->count % POOL_BITS))
+			avail &= ((size_t)1 << (c->count % POOL_BITS)) - 1u;
+		for (; avail && n < count; avail &= avail - 1u) {
+			const size_t bit = bit_ffs(avail);
+			take |= (size_t)1 << bit;
+			ptrs[n++] = &arena_mem(a)[c->blocks + (((i * POOL_BITS) + bit) * size)];
 		}
-		if (oldsz == 0) { /* new allocation */
-			a->nofree = alignup(a->nofree);
-			if ((a->nofree + newsz) > a->arena_len)
-				return NULL;
-			void *r = &a->aligned[a->nofree];
-			a->nofree += newsz;
+		if (take) {
+			atomic_or(a, &map[i], take);
+			c->hint = i;
+		}
+	}
+	if (n < count)
+		atomic_and(a, &a->pool.avail, ~((size_t)1 << cls));
+	arena_unlock(a, &c->lock);
+	atomic_add(a, &a->pool.used, n * size);
+	atomic_sub(a, &a->pool.free, n * size);
+	return n;
+}
+
+static size_t pool_malloc_batch(allocator_t *a, size_t size, size_t count, void **ptrs) {
+	size_t n = 0;
+	for (size_t cls = pool_class(size); cls < ALLOCATOR_POOL_CLASSES && n < count; cls++)
+		if (atomic_get(a, &a->pool.avail) & ((size_t)1 << cls))
+			n += pool_class_batch(a, cls, &ptrs[n], count - n);
+	return n;
+}
+
+static void pool_clear(allocator_t *a, size_t cls, size_t unit, size_t mask, int unlock) {
+	if (cls >= ALLOCATOR_POOL_CLASSES)
+		return;
+	pclass_t *c = &a->pool.classes[cls];
+	if (mask) {
+		atomic_and(a, &pool_map(a, c)[unit], ~mask);
+		c->hint = unit;
+	}
+	if (unlock) {
+		atomic_or(a, &a->pool.avail, (size_t)1 << cls);
+		arena_unlock(a, &c->lock);
+	}
+}
+
+/* Clears of the same bitmap unit are gathered into one write */
+static int pool_free_batch(allocator_t *a, void **ptrs, size_t count, size_t *freed) {
+	size_t held = ALLOCATOR_POOL_CLASSES, unit = 0, mask = 0, bytes = 0;
+	int r = 0;
+	*freed = 0;
+	for (size_t i = 0; i < count; i++) {
+		size_t cls = 0, block = 0;
+		if (!ptrs[i])
+			continue;
+		const int bad = pool_locate(a, ptrs[i], &cls, &block) < 0;
+		const size_t bit = (size_t)1 << (block % POOL_BITS);
+		if (!bad && cls == held && (block / POOL_BITS) == unit) {
+			if (!(mask & bit)) {
+				mask |= bit;
+				bytes += pool_class_size(cls);
+				(*freed)++;
+				continue;
+			}
+		} else if (!bad) {
+			pool_clear(a, held, unit, mask, cls != held);
+			if (cls != held)
+				arena_lock(a, &a->pool.classes[cls].lock);
+			held = cls;
+			unit = block / POOL_BITS;
+			mask = bit;
+			bytes += pool_class_size(cls);
+			(*freed)++;
+			continue;
+		}
+		r = adie(a, "invalid free %p", ptrs[i]);
+		break;
+	}
+	pool_clear(a, held, unit, mask, 1);
+	atomic_sub(a, &a->pool.used, bytes);
+	atomic_add(a, &a->pool.free, bytes);
+	return r;
+}
+
+static void *pool_allocator(allocator_t *a, void *ptr, size_t oldsz, size_t newsz) {
+#if ALLOCATOR_VERIFY_SIZE
+	if (ptr && (a->flags & ALLOCATOR_FLAG_SIZED)) { /* the class is found from the pointer, 'oldsz' must fit it */
+		size_t cls = 0, block = 0;
+		if (pool_locate(a, ptr, &cls, &block) < 0 || oldsz == 0 || oldsz > pool_class_size(cls)) {
+			(void)adie(a, "invalid size %zu for %p", oldsz, ptr);
+			return NULL;
+		}
+	}
+#else
+	UNUSED(oldsz);
+#endif
+	if (newsz == 0) {
+		if (ptr)
+			(void)pool_free(a, ptr);
+		return NULL;
+	}
+	if (ptr == NULL)
+		return pool_malloc(a, newsz);
+	size_t cls = 0, block = 0;
+	if (pool_locate(a, ptr, &cls, &block) < 0) {
+		(void)adie(a, "invalid realloc %p", ptr);
+		return NULL;
+	}
+	const size_t size = pool_class_size(cls);
+	if (newsz <= size)
+		return ptr;
+	void *r = pool_malloc(a, newsz);
+	if (!r)
+		return NULL;
+	memcpy(r, ptr, size);
+	(void)pool_free(a, ptr);
+	return r;
+}
+
+/* Blocks are naturally aligned when formatted, so any class at least as
+ * large as the alignment will do unless the arena has been moved. */
+static void *pool_aligned(allocator_t *a, size_t n, size_t align) {
+	for (size_t cls = pool_class(n > align ? n : align); cls < ALLOCATOR_POOL_CLASSES; cls++) {
+		if (!(atomic_get(a, &a->pool.avail) & ((size_t)1 << cls)))
+			continue;
+		if ((uintptr_t)&arena_mem(a)[a->pool.classes[cls].blocks] & (align - 1u))
+			continue;
+		void *r = pool_class_malloc(a, cls);
+		if (r)
 			return r;
+	}
+	return NULL;
+}
+
+static size_t pool_largest(allocator_t *a) {
+	const size_t avail = atomic_get(a, &a->pool.avail);
+	return avail ? pool_class_size(bit_fls(avail)) : 0;
+}
+
+static int pool_format(allocator_t *a) {
+	check(a);
+	pool_t *p = &a->pool;
+	BUILD_BUG_ON(ALLOCATOR_POOL_CLASSES > (sizeof (size_t) * CHAR_BIT));
+	p->start = 0;
+	p->region = (a->arena_len / ALLOCATOR_POOL_CLASSES) & ~ALIGN_MASK;
+	p->avail = 0;
+	p->used = 0;
+	p->free = 0;
+	for (size_t i = 0; i < ALLOCATOR_POOL_CLASSES; i++) {
+		pclass_t *c = &p->classes[i];
+		const size_t size = pool_class_size(i), start = p->start + (i * p->region);
+		size_t count = (p->region * CHAR_BIT) / ((size * CHAR_BIT) + 1u), maplen = 0, pad = 0;
+		for (; count; count--) {
+			maplen = alignup(((count + POOL_BITS - 1u) / POOL_BITS) * sizeof (size_t));
+			const uintptr_t blocks = (uintptr_t)&arena_mem(a)[start + maplen];
+			pad = ((blocks + size - 1u) & ~(uintptr_t)(size - 1u)) - blocks; /* natural alignment */
+			if ((maplen + pad + (count * size)) <= p->region)
+				break;
+		}
+		c->map = start;
+		c->blocks = start + maplen + pad;
+		c->count = count;
+		c->hint = 0;
+		c->lock = 0;
+		if (!count) /* arena too small for this class */
+			continue;
+		memset(&arena_mem(a)[c->map], 0, maplen);
+		p->avail |= (size_t)1 << i;
+		p->free += count * size;
+	}
+	return p->avail ? 0 : -1;
+}
+
+static inline size_t *buddy_head(allocator_t *a, size_t k) {
+	check(k < a->buddy.orders);
+	return &((size_t*)&arena_mem(a)[a->buddy.heads])[k];
+}
+
+static inline lfree_t *buddy_links(allocator_t *a, size_t off) {
+	return (lfree_t*)&arena_mem(a)[off];
+}
+
+static inline size_t buddy_offset(allocator_t *a, size_t u) {
+	return a->buddy.start + (u * BUDDY_MIN);
+}
+
+static inline size_t buddy_root(allocator_t *a, size_t u) { /* order of the root block 'u' is in */
+	check(u < a->buddy.units);
+	return bit_fls(u ^ a->buddy.units);
+}
+
+static inline int buddy_bit(allocator_t *a, size_t map, size_t k, size_t u) {
+	const size_t n = (a->buddy.span >> k) + (u >> k);
+	return !!(((size_t*)&arena_mem(a)[map])[n / POOL_BITS] & ((size_t)1 << (n % POOL_BITS)));
+}
+
+static inline void buddy_mark(allocator_t *a, size_t map, size_t k, size_t u, int set) {
+	const size_t n = (a->buddy.span >> k) + (u >> k);
+	size_t *m = &((size_t*)&arena_mem(a)[map])[n / POOL_BITS];
+	*m = set ? *m | ((size_t)1 << (n % POOL_BITS)) : *m & ~((size_t)1 << (n % POOL_BITS));
+}
+
+static void buddy_push(allocator_t *a, size_t u, size_t k) {
+	const size_t off = buddy_offset(a, u);
+	size_t *head = buddy_head(a, k);
+	lfree_t *l = buddy_links(a, off);
+	l->prev = 0;
+	l->next = *head;
+	if (*head)
+		buddy_links(a, *head)->prev = off;
+	*head = off;
+	a->buddy.avail |= (size_t)1 << k;
+	a->buddy.free += BUDDY_MIN << k;
+	buddy_mark(a, a->buddy.free_map, k, u, 1);
+}
+
+static void buddy_remove(allocator_t *a, size_t u, size_t k) {
+	const size_t off = buddy_offset(a, u);
+	lfree_t *l = buddy_links(a, off);
+	if (l->next)
+		buddy_links(a, l->next)->prev = l->prev;
+	if (l->prev)
+		buddy_links(a, l->prev)->next = l->next;
+	else if (!(*buddy_head(a, k) = l->next))
+		a->buddy.avail &= ~((size_t)1 << k);
+	a->buddy.free -= BUDDY_MIN << k;
+	buddy_mark(a, a->buddy.free_map, k, u, 0);
+}
+
+static inline size_t buddy_order(size_t n) { /* smallest order that fits 'n' bytes */
+	const size_t m = (n + BUDDY_MIN - 1u) / BUDDY_MIN;
+	return m > 1u ? bit_fls(m - 1u) + 1u : 0;
+}
+
+/* Take the block of order 'k' at unit 'v' out of the free block of order 'j'
+ * at 'u', freeing the halves it is not in on the way down. */
+static void *buddy_take(allocator_t *a, size_t u, size_t j, size_t v, size_t k) {
+	check(v >= u && (v + ((size_t)1 << k)) <= (u + ((size_t)1 << j)));
+	buddy_remove(a, u, j);
+	for (; j > k; j--) {
+		const size_t half = (size_t)1 << (j - 1u);
+		buddy_mark(a, a->buddy.split_map, j, u, 1);
+		if (v >= (u + half)) {
+			buddy_push(a, u, j - 1u);
+			u += half;
 		} else {
+			buddy_push(a, u + half, j - 1u);
 		}
-		break;
 	}
-	case ALLOCATOR_TYPE_FAIL: return NULL;
-	case ALLOCATOR_TYPE_LIST: return NULL; // Not implemented yet
+	a->buddy.used += BUDDY_MIN << k;
+	return &arena_mem(a)[buddy_offset(a, v)];
+}
+
+static void *buddy_malloc(allocator_t *a, size_t n) {
+	if (n == 0 || n > a->arena_len)
+		return NULL;
+	const size_t k = buddy_order(n);
+	if (k >= a->buddy.orders)
+		return NULL;
+	const size_t avail = a->buddy.avail & (~(size_t)0 << k);
+	if (!avail)
+		return NULL;
+	const size_t j = bit_ffs(avail), u = (*buddy_head(a, j) - a->buddy.start) / BUDDY_MIN;
+	return buddy_take(a, u, j, u, k);
+}
+
+/* Blocks are aligned to their size, in units, from the first block (which is
+ * aligned to at least BUDDY_MIN), so an aligned block is one at a unit congruent to
+ * 'c' modulo 'step'; the free lists are searched for a block containing one. */
+static void *buddy_aligned(allocator_t *a, size_t n, size_t align) {
+	if (align <= BUDDY_MIN)
+		return buddy_malloc(a, n);
+	if (n == 0 || n > a->arena_len)
+		return NULL;
+	const size_t k = buddy_order(n), units = align / BUDDY_MIN;
+	if (k >= a->buddy.orders)
+		return NULL;
+	const size_t c = ((align - ((uintptr_t)&arena_mem(a)[a->buddy.start] & (align - 1u))) & (align - 1u)) / BUDDY_MIN;
+	const size_t step = units > ((size_t)1 << k) ? units : (size_t)1 << k;
+	if (c & (((size_t)1 << k) - 1u))
+		return NULL;
+	for (size_t avail = a->buddy.avail & (~(size_t)0 << k); avail; avail &= avail - 1u) {
+		const size_t j = bit_ffs(avail);
+		for (size_t off = *buddy_head(a, j); off; off = buddy_links(a, off)->next) {
+			const size_t u = (off - a->buddy.start) / BUDDY_MIN, v = u + ((c - u) & (step - 1u));
+			if ((v + ((size_t)1 << k)) <= (u + ((size_t)1 << j)))
+				return buddy_take(a, u, j, v, k);
+		}
 	}
 	return NULL;
 }
 
+/* Find the unit and order of a block, returning -1 if 'ptr' is not the
+ * start of one or else its ALLOCATOR_WALK_ state */
+static int buddy_state(allocator_t *a, void *ptr, size_t *unit, size_t *order) {
+	check(unit);
+	check(order);
+	unsigned char *p = ptr;
+	if (p < &arena_mem(a)[a->buddy.start])
+		return -1;
+	const size_t off = p - &arena_mem(a)[a->buddy.start], u = off / BUDDY_MIN;
+	if ((off % BUDDY_MIN) || u >= a->buddy.units)
+		return -1;
+	size_t k = buddy_root(a, u);
+	while (k && buddy_bit(a, a->buddy.split_map, k, u))
+		k--;
+	if (u & (((size_t)1 << k) - 1u))
+		return -1;
+	*unit = u;
+	*order = k;
+	return buddy_bit(a, a->buddy.free_map, k, u) ? ALLOCATOR_WALK_FREE : ALLOCATOR_WALK_USED;
+}
+
+/* Find the unit and order of an allocated block, or return -1 */
+static int buddy_locate(allocator_t *a, void *ptr, size_t *unit, size_t *order) {
+	return buddy_state(a, ptr, unit, order) == ALLOCATOR_WALK_USED ? 0 : -1;
+}
+
+static int buddy_free(allocator_t *a, void *ptr) {
+	size_t u = 0, k = 0;
+	if (buddy_locate(a, ptr, &u, &k) < 0)
+		return adie(a, "invalid free %p", ptr);
+	const size_t freed = buddy_offset(a, u), freed_end = freed + (BUDDY_MIN << k);
+	a->buddy.used -= BUDDY_MIN << k;
+	for (const size_t root = buddy_root(a, u); k < root; k++) {
+		const size_t b = u ^ ((size_t)1 << k);
+		if (!buddy_bit(a, a->buddy.free_map, k, b))
+			break;
+		buddy_remove(a, b, k);
+		u &= ~((size_t)1 << k);
+		buddy_mark(a, a->buddy.split_map, k + 1u, u, 0);
+	}
+	buddy_push(a, u, k);
+	if (a->flags & ALLOCATOR_FLAG_RELEASE) { /* as with the list allocator the links must stay */
+		const uintptr_t m = (uintptr_t)arena_mem(a), keep = m + buddy_offset(a, u) + BUDDY_MIN;
+		arena_decommit(a, m + freed > keep ? m + freed : keep, m + freed_end);
+	}
+	return 0;
+}
+
+/* Shrinking splits the block in place, giving back the upper halves */
+static void *buddy_realloc(allocator_t *a, void *ptr, size_t newsz) {
+	size_t u = 0, k = 0;
+	if (buddy_locate(a, ptr, &u, &k) < 0) {
+		(void)adie(a, "invalid realloc %p", ptr);
+		return NULL;
+	}
+	if (newsz > (BUDDY_MIN << k)) {
+		void *r = buddy_malloc(a, newsz);
+		if (!r)
+			return NULL;
+		memcpy(r, ptr, BUDDY_MIN << k);
+		(void)buddy_free(a, ptr);
+		return r;
+	}
+	for (; k && newsz <= (BUDDY_MIN << (k - 1u)); k--) {
+		buddy_mark(a, a->buddy.split_map, k, u, 1);
+		buddy_push(a, u + ((size_t)1 << (k - 1u)), k - 1u);
+		a->buddy.used -= BUDDY_MIN << (k - 1u);
+	}
+	return ptr;
+}
+
+static void *buddy_allocator(allocator_t *a, void *ptr, size_t newsz) {
+	if (newsz == 0) {
+		if (ptr)
+			(void)buddy_free(a, ptr);
+		return NULL;
+	}
+	if (ptr == NULL)
+		return buddy_malloc(a, newsz);
+	return buddy_realloc(a, ptr, newsz);
+}
+
+static size_t buddy_largest(allocator_t *a) {
+	return a->buddy.avail ? BUDDY_MIN << bit_fls(a->buddy.avail) : 0;
+}
+
+static int buddy_format(allocator_t *a) {
+	check(a);
+	buddy_t *b = &a->buddy;
+	BUILD_BUG_ON(sizeof (lfree_t) > BUDDY_MIN);
+	memset(b, 0, sizeof (*b));
+	size_t units = a->arena_len / BUDDY_MIN, align = ALLOCATOR_PAGE;
+	while (align > BUDDY_MIN && (align * 16u) > a->arena_len) /* blocks up to a page are naturally aligned */
+		align /= 2u;
+	for (;;) { /* the metadata needed shrinks with the number of units */
+		if (units == 0)
+			return -1;
+		b->span = (size_t)1 << (bit_fls(units) + !!(units & (units - 1u)));
+		b->orders = bit_fls(b->span) + 1u;
+		const size_t maplen = alignup((((2u * b->span) + POOL_BITS - 1u) / POOL_BITS) * sizeof (size_t));
+		b->split_map = alignup(b->orders * sizeof (size_t));
+		b->free_map = b->split_map + maplen;
+		const uintptr_t m = (uintptr_t)arena_mem(a);
+		b->start = ((m + b->free_map + maplen + align - 1u) & ~(uintptr_t)(align - 1u)) - m;
+		if (b->start >= a->arena_len)
+			return -1;
+		const size_t fit = (a->arena_len - b->start) / BUDDY_MIN;
+		if (fit >= units)
+			break;
+		units = fit;
+	}
+	b->units = units;
+	check(b->orders <= (sizeof (size_t) * CHAR_BIT));
+	memset(arena_mem(a), 0, b->start);
+	for (size_t k = b->orders, u = 0; k--;) /* a root for each set bit, largest first */
+		if (units & ((size_t)1 << k)) {
+			buddy_push(a, u, k);
+			u += (size_t)1 << k;
+		}
+	return 0;
+}
+
+static inline void **cache_stack(allocator_t *a, size_t cls) {
+	check(cls < ALLOCATOR_CACHE_CLASSES);
+	return &((void**)&arena_mem(a)[a->cache.stacks])[cls * ALLOCATOR_CACHE_DEPTH];
+}
+
+/* Magazines are swapped with the shared arena a batch at a time so its lock
+ * is taken once per batch, a refill falls back to one block at a time when
+ * the shared arena cannot supply a whole batch. */
+static size_t cache_refill(allocator_t *a, size_t cls) {
+	void **s = cache_stack(a, cls);
+	const size_t size = pool_class_size(cls);
+	size_t n = a->cache.depth[cls];
+	if (n < CACHE_BATCH && allocator_alloc_batch(a->cache.shared, size, CACHE_BATCH - n, &s[n]) >= 0)
+		n = CACHE_BATCH;
+	for (; n < CACHE_BATCH; n++)
+		if (!(s[n] = allocator(a->cache.shared, NULL, 0, size)))
+			break;
+	a->cache.depth[cls] = n;
+	return n;
+}
+
+static void cache_drain(allocator_t *a, size_t cls, size_t keep) {
+	void **s = cache_stack(a, cls);
+	size_t sizes[ALLOCATOR_CACHE_DEPTH];
+	const size_t depth = a->cache.depth[cls];
+	if (depth <= keep)
+		return;
+	for (size_t i = keep; i < depth; i++)
+		sizes[i - keep] = pool_class_size(cls);
+	(void)allocator_free_batch(a->cache.shared, &s[keep], sizes, depth - keep);
+	a->cache.depth[cls] = keep;
+}
+
+static void *cache_malloc(allocator_t *a, size_t n) {
+	if (n > CACHE_MAX) {
+		void *r = allocator(a->cache.shared, NULL, 0, n);
+		a->cache.used += r ? n : 0;
+		return r;
+	}
+	const size_t cls = pool_class(n);
+	if (!a->cache.depth[cls] && !cache_refill(a, cls))
+		return NULL;
+	a->cache.used += pool_class_size(cls);
+	return cache_stack(a, cls)[--a->cache.depth[cls]];
+}
+
+static void cache_free(allocator_t *a, void *ptr, size_t oldsz) {
+	if (oldsz > CACHE_MAX) {
+		(void)allocator(a->cache.shared, ptr, oldsz, 0);
+		a->cache.used -= oldsz;
+		return;
+	}
+	const size_t cls = pool_class(oldsz);
+	a->cache.used -= pool_class_size(cls);
+	if (a->cache.depth[cls] == ALLOCATOR_CACHE_DEPTH)
+		cache_drain(a, cls, ALLOCATOR_CACHE_DEPTH / 2u);
+	cache_stack(a, cls)[a->cache.depth[cls]++] = ptr;
+}
+
+static size_t cache_held(allocator_t *a) { /* bytes in magazines */
+	size_t n = 0;
+	for (size_t i = 0; i < ALLOCATOR_CACHE_CLASSES; i++)
+		n += a->cache.depth[i] * pool_class_size(i);
+	return n;
+}
+
+static void *cache_allocator(allocator_t *a, void *ptr, size_t oldsz, size_t newsz) {
+	if (ptr && (!a->cache.shared || oldsz == 0)) {
+		(void)adie(a, "size needed for %p", ptr);
+		return NULL;
+	}
+	if (!a->cache.shared)
+		return NULL;
+	if (newsz == 0) {
+		if (ptr)
+			cache_free(a, ptr, oldsz);
+		return NULL;
+	}
+	if (ptr == NULL)
+		return cache_malloc(a, newsz);
+	if (oldsz > CACHE_MAX && newsz > CACHE_MAX) { /* let the shared arena resize in place */
+		void *r = allocator(a->cache.shared, ptr, oldsz, newsz);
+		a->cache.used += r ? newsz - oldsz : 0; /* wraps back when shrinking */
+		return r;
+	}
+	if (oldsz <= CACHE_MAX && newsz <= CACHE_MAX && pool_class(oldsz) == pool_class(newsz))
+		return ptr;
+	void *r = cache_malloc(a, newsz);
+	if (!r)
+		return NULL;
+	memcpy(r, ptr, oldsz < newsz ? oldsz : newsz);
+	cache_free(a, ptr, oldsz);
+	return r;
+}
+
+static int cache_format(allocator_t *a) {
+	check(a);
+	BUILD_BUG_ON(ALLOCATOR_CACHE_DEPTH < 2u);
+	a->cache.shared = NULL;
+	a->cache.stacks = 0;
+	memset(a->cache.depth, 0, sizeof (a->cache.depth));
+	a->cache.used = 0;
+	if (a->arena_len < (ALLOCATOR_CACHE_CLASSES * ALLOCATOR_CACHE_DEPTH * sizeof (void*)))
+		return -1;
+	return 0;
+}
+
+static inline allocator_t *multi_sub(allocator_t *a, size_t i) {
+	check(i < a->multi.count);
+	return (allocator_t*)&arena_mem(a)[i * a->multi.stride];
+}
+
+static allocator_t *multi_locate(allocator_t *a, void *ptr) {
+	const uintptr_t p = (uintptr_t)ptr, m = (uintptr_t)arena_mem(a);
+	if (p < m || ((p - m) / a->multi.stride) >= a->multi.count)
+		return NULL;
+	return multi_sub(a, (p - m) / a->multi.stride);
+}
+
+static void *multi_malloc(allocator_t *a, size_t newsz, size_t align) {
+	const size_t local = thread_slot() % a->multi.count;
+	void *r = allocator_aligned(multi_sub(a, local), newsz, align);
+	if (r)
+		return r;
+	size_t victim = local, most = 0;
+	for (size_t i = 0; i < a->multi.count; i++) {
+		size_t largest = 0;
+		if (i == local || allocator_get_max_allocatable(multi_sub(a, i), &largest) < 0)
+			continue;
+		if (largest > most) {
+			most = largest;
+			victim = i;
+		}
+	}
+	if (victim == local)
+		return NULL;
+	return allocator_aligned(multi_sub(a, victim), newsz, align);
+}
+
+static void *multi_allocator(allocator_t *a, void *ptr, size_t oldsz, size_t newsz) {
+	if (a->multi.count == 0)
+		return NULL;
+	if (ptr == NULL)
+		return newsz ? multi_malloc(a, newsz, ALLOCATOR_ALIGNMENT) : NULL;
+	allocator_t *sub = multi_locate(a, ptr);
+	if (!sub) {
+		(void)adie(a, "invalid pointer %p", ptr);
+		return NULL;
+	}
+	void *r = allocator(sub, ptr, oldsz, newsz);
+	if (r || newsz == 0)
+		return r;
+	if (!(r = multi_malloc(a, newsz, ALLOCATOR_ALIGNMENT))) /* move to another sub-arena */
+		return NULL;
+	memcpy(r, ptr, oldsz < newsz ? oldsz : newsz);
+	(void)allocator(sub, ptr, oldsz, 0);
+	return r;
+}
+
+static void multi_stats(allocator_t *a, allocator_stats_t *s) {
+	for (size_t i = 0; i < a->multi.count; i++) {
+		allocator_stats_t t;
+		if (allocator_get_stats(multi_sub(a, i), &t) < 0)
+			continue;
+		s->used    += t.used;
+		s->free    += t.free;
+		s->peak    += t.peak; /* sum of peaks, an upper bound */
+		s->largest = t.largest > s->largest ? t.largest : s->largest;
+	}
+}
+
+int allocator_format(void **arena, int type, unsigned char *buf, size_t len) {
+	check(arena);
+	check(buf);
+	*arena = NULL;
+	unsigned char *aligned = (unsigned char*)alignup((uintptr_t)buf);
+	const int flags = type & ~ALLOCATOR_TYPE_MASK;
+	type &= ALLOCATOR_TYPE_MASK;
+	type = type == ALLOCATOR_TYPE_DEFAULT ? ALLOCATOR_TYPE_LIST : type;
+	if (flags & ~(ALLOCATOR_FLAG_ZERO | ALLOCATOR_FLAG_THREAD_SAFE | ALLOCATOR_FLAG_HUGE | ALLOCATOR_FLAG_RELEASE | ALLOCATOR_FLAG_SIZED))
+		return -1;
+	if ((flags & ALLOCATOR_FLAG_THREAD_SAFE) && !ALLOCATOR_ATOMICS)
+		return -1;
+	allocator_t a = {
+		.magic = ARENA_MAGIC,
+		.pad = aligned - buf,
+		.trace = NULL,
+		.buf_len = len,
+		.error = 0,
+		.type = type,
+		.flags = flags,
+	};
+	switch (type) {
+	case ALLOCATOR_TYPE_LIST:
+	case ALLOCATOR_TYPE_NO_FREE:
+	case ALLOCATOR_TYPE_FAIL:
+	case ALLOCATOR_TYPE_POOL:
+	case ALLOCATOR_TYPE_BUDDY:
+	case ALLOCATOR_TYPE_MULTI: /* no sub-arenas until 'allocator_format_multi' adds them */
+		break;
+	case ALLOCATOR_TYPE_CACHE:
+		if (flags & ALLOCATOR_FLAG_THREAD_SAFE) /* caches are per thread */
+			return -1;
+		break;
+	default:
+		return -1;
+	}
+
+	if (len < ((sizeof (a) + ALLOCATOR_ALIGNMENT) * 2ull))
+		return -1;
+	a.base = alignup(sizeof (a));
+	a.arena_len = len - a.pad - a.base;
+	allocator_t old, *h = (allocator_t*)aligned; /* format in place, arena is relative to header */
+	memcpy(&old, h, sizeof old);
+	memcpy(h, &a, sizeof a);
+	if ((type == ALLOCATOR_TYPE_LIST && list_format(h) < 0) ||
+		(type == ALLOCATOR_TYPE_POOL && pool_format(h) < 0) ||
+		(type == ALLOCATOR_TYPE_BUDDY && buddy_format(h) < 0) ||
+		(type == ALLOCATOR_TYPE_CACHE && cache_format(h) < 0)) {
+		memcpy(h, &old, sizeof old);
+		return -1;
+	}
+	*arena = (void*)h;
+	return 0;
+}
+
+int allocator_format_cache(void **arena, void *shared, unsigned char *buf, size_t len) {
+	check(arena);
+	arena_validate(shared);
+	const int r = allocator_format(arena, ALLOCATOR_TYPE_CACHE, buf, len);
+	if (r < 0)
+		return r;
+	((allocator_t*)*arena)->cache.shared = shared;
+	return 0;
+}
+
+int allocator_format_multi(void **arena, int type, size_t count, unsigned char *buf, size_t len) {
+	check(arena);
+	const int sub = (type & ALLOCATOR_TYPE_MASK) == ALLOCATOR_TYPE_DEFAULT ? ALLOCATOR_TYPE_LIST : (type & ALLOCATOR_TYPE_MASK);
+	const int flags = (type & ~ALLOCATOR_TYPE_MASK) | (ALLOCATOR_ATOMICS ? ALLOCATOR_FLAG_THREAD_SAFE : 0);
+	*arena = NULL;
+	if (count == 0 || sub == ALLOCATOR_TYPE_CACHE || sub == ALLOCATOR_TYPE_MULTI)
+		return -1;
+	void *m = NULL;
+	if (allocator_format(&m, ALLOCATOR_TYPE_MULTI | (flags & ALLOCATOR_FLAG_THREAD_SAFE), buf, len) < 0)
+		return -1;
+	allocator_t *a = m;
+	const size_t stride = (a->arena_len / count) & ~ALIGN_MASK;
+	for (size_t i = 0; i < count; i++) {
+		void *s = NULL;
+		if (allocator_format(&s, sub | flags, &arena_mem(a)[i * stride], stride) < 0)
+			return -1;
+		check(s == (void*)&arena_mem(a)[i * stride]);
+	}
+	a->multi.stride = stride;
+	a->multi.count = count;
+	*arena = m;
+	return 0;
+}
+
+int allocator_reformat(void *arena, int type) {
+	arena_validate(arena);
+	allocator_t *a = arena;
+	void *newarena = arena, *shared = NULL;
+	if (a->type == ALLOCATOR_TYPE_MULTI && (type & ALLOCATOR_TYPE_MASK) == ALLOCATOR_TYPE_MULTI) {
+		if (a->multi.count == 0)
+			return -1;
+		const allocator_t *sub = multi_sub(a, 0); /* keep the layout and sub-arena type */
+		const int r = allocator_format_multi(&newarena, sub->type | (type & ~ALLOCATOR_TYPE_MASK), a->multi.count, arena_buf(a), a->buf_len);
+		implies(r >= 0, newarena == arena);
+		return r;
+	}
+	if (a->type == ALLOCATOR_TYPE_CACHE) { /* return cached blocks before forgetting them */
+		(void)allocator_flush(arena);
+		shared = a->cache.shared;
+	}
+	const int r = allocator_format(&newarena, type, arena_buf(a), a->buf_len);
+	implies(r >= 0, newarena == arena);
+	if (r >= 0 && a->type == ALLOCATOR_TYPE_CACHE)
+		a->cache.shared = shared;
+	return r;
+}
+
+/* Walking visits every block in address order (sub-arena by sub-arena for a
+ * multi arena, and the shared arena for a cache, where cached blocks are in
+ * use) with the lock for it held, so 'walk' must not call into the arena. A
+ * non-zero return from 'walk' stops the walk and is returned. Slabs in a
+ * sized arena are walked slot by slot, objects in a NO_FREE arena have no
+ * boundaries so the allocated part of it is a single ALLOCATOR_WALK_SPAN. */
+static int list_walk(allocator_t *a, allocator_walk_fn walk, void *param) {
+	for (size_t off = a->list.start; off < a->list.end;) {
+		lblock_t *b = list_block(a, off);
+		unsigned char *p = &arena_mem(a)[off + LIST_HDR];
+		const slab_t *s = (const slab_t*)p;
+		int r = 0;
+		if (!(b->size & LIST_FREE) && (a->flags & ALLOCATOR_FLAG_SIZED) && !((uintptr_t)p & (ALLOCATOR_SLAB_SIZE - 1u)) && s->magic == SLAB_MAGIC) {
+			for (size_t i = 0; i < slab_count((slab_t*)s) && !r; i++) {
+				const int used = !!(s->map[i / POOL_BITS] & ((size_t)1 << (i % POOL_BITS)));
+				r = walk(param, p + SLAB_HDR + (i * s->size), s->size, used ? ALLOCATOR_WALK_USED : ALLOCATOR_WALK_FREE);
+			}
+		} else {
+			r = walk(param, p, list_size(b) - LIST_HDR, b->size & LIST_FREE ? ALLOCATOR_WALK_FREE : ALLOCATOR_WALK_USED);
+		}
+		if (r)
+			return r;
+		off += list_size(b);
+	}
+	return 0;
+}
+
+static int pool_walk(allocator_t *a, allocator_walk_fn walk, void *param) {
+	for (size_t cls = 0; cls < ALLOCATOR_POOL_CLASSES; cls++) {
+		pclass_t *c = &a->pool.classes[cls];
+		const size_t size = pool_class_size(cls), *map = pool_map(a, c);
+		int r = 0;
+		arena_lock(a, &c->lock);
+		for (size_t i = 0; i < c->count && !r; i++) {
+			const int used = !!(atomic_get(a, (size_t*)&map[i / POOL_BITS]) & ((size_t)1 << (i % POOL_BITS)));
+			r = walk(param, &arena_mem(a)[c->blocks + (i * size)], size, used ? ALLOCATOR_WALK_USED : ALLOCATOR_WALK_FREE);
+		}
+		arena_unlock(a, &c->lock);
+		if (r)
+			return r;
+	}
+	return 0;
+}
+
+static int buddy_walk(allocator_t *a, allocator_walk_fn walk, void *param) {
+	for (size_t u = 0; u < a->buddy.units;) {
+		size_t k = buddy_root(a, u);
+		while (k && buddy_bit(a, a->buddy.split_map, k, u))
+			k--;
+		const int free = buddy_bit(a, a->buddy.free_map, k, u);
+		const int r = walk(param, &arena_mem(a)[buddy_offset(a, u)], BUDDY_MIN << k, free ? ALLOCATOR_WALK_FREE : ALLOCATOR_WALK_USED);
+		if (r)
+			return r;
+		u += (size_t)1 << k;
+	}
+	return 0;
+}
+
+int allocator_walk(void *arena, allocator_walk_fn walk, void *param) {
+	arena_validate(arena);
+	check(walk);
+	allocator_t *a = arena;
+	int r = 0;
+	if (a->error < 0)
+		return a->error;
+	switch (a->type) {
+	case ALLOCATOR_TYPE_LIST:
+		arena_lock(a, &a->lock);
+		r = list_walk(a, walk, param);
+		arena_unlock(a, &a->lock);
+		break;
+	case ALLOCATOR_TYPE_POOL: r = pool_walk(a, walk, param); break;
+	case ALLOCATOR_TYPE_BUDDY:
+		arena_lock(a, &a->lock);
+		r = buddy_walk(a, walk, param);
+		arena_unlock(a, &a->lock);
+		break;
+	case ALLOCATOR_TYPE_NO_FREE: {
+		const size_t top = atomic_get(a, &a->nofree);
+		if (top)
+			r = walk(param, arena_mem(a), top, ALLOCATOR_WALK_SPAN);
+		if (!r && top < a->arena_len)
+			r = walk(param, &arena_mem(a)[top], a->arena_len - top, ALLOCATOR_WALK_FREE);
+		break;
+	}
+	case ALLOCATOR_TYPE_CACHE:
+		if (a->cache.shared)
+			r = allocator_walk(a->cache.shared, walk, param);
+		break;
+	case ALLOCATOR_TYPE_MULTI:
+		for (size_t i = 0; i < a->multi.count && !r; i++)
+			r = allocator_walk(multi_sub(a, i), walk, param);
+		break;
+	case ALLOCATOR_TYPE_FAIL: break;
+	}
+	return r;
+}
+
+/* The state of the list block at 'off', or -1 if there is none: a header is
+ * only believed if both neighbours agree on where it starts and ends, 'prev'
+ * is kept up to date for used blocks as well as free ones for this. */
+static int list_state(allocator_t *a, size_t off) {
+	if ((off & ALIGN_MASK) || off < a->list.start || off >= a->list.end)
+		return -1;
+	lblock_t *b = list_block(a, off);
+	const size_t size = list_size(b);
+	if (size < LIST_MIN || (size & ALIGN_MASK) || size > (a->list.end - off) || list_block(a, off + size)->prev != off)
+		return -1;
+	if (off != a->list.start && (b->prev < a->list.start || b->prev >= off || (b->prev + list_size(list_block(a, b->prev))) != off))
+		return -1;
+	return (b->size & LIST_FREE) ? ALLOCATOR_WALK_FREE : ALLOCATOR_WALK_USED;
+}
+
+/* Slabs are found by masking as on the free path, a pointer into a live slab
+ * is a block only if it is the start of a slot. */
+static int list_ptr_state(allocator_t *a, void *ptr) {
+	const uintptr_t p = (uintptr_t)ptr, m = (uintptr_t)arena_mem(a), base = p & ~(uintptr_t)(ALLOCATOR_SLAB_SIZE - 1u);
+	if (p < m + LIST_HDR)
+		return -1;
+	if ((a->flags & ALLOCATOR_FLAG_SIZED) && base >= m + LIST_HDR && list_state(a, base - m - LIST_HDR) == ALLOCATOR_WALK_USED) {
+		slab_t *s = (slab_t*)base;
+		if (s->magic == SLAB_MAGIC) {
+			if ((p - base) < SLAB_HDR || ((p - base - SLAB_HDR) % s->size) || ((p - base - SLAB_HDR) / s->size) >= slab_count(s))
+				return -1;
+			const size_t slot = (p - base - SLAB_HDR) / s->size;
+			return (s->map[slot / POOL_BITS] & ((size_t)1 << (slot % POOL_BITS))) ? ALLOCATOR_WALK_USED : ALLOCATOR_WALK_FREE;
+		}
+	}
+	return list_state(a, p - m - LIST_HDR);
+}
+
+/* Look up the state of the block starting at 'ptr' (or any pointer into the
+ * allocated part of a NO_FREE arena, where object boundaries are not kept)
+ * directly, giving the same answer a walk of the arena would (or -1 if none). */
+static int arena_state(allocator_t *a, void *ptr, int *state) {
+	if (a->error < 0)
+		return a->error;
+	const uintptr_t p = (uintptr_t)ptr, m = (uintptr_t)arena_mem(a);
+	size_t x = 0, y = 0;
+	*state = -1;
+	switch (a->type) {
+	case ALLOCATOR_TYPE_LIST:
+		arena_lock(a, &a->lock);
+		*state = list_ptr_state(a, ptr);
+		arena_unlock(a, &a->lock);
+		break;
+	case ALLOCATOR_TYPE_POOL: *state = pool_state(a, ptr, &x, &y); break;
+	case ALLOCATOR_TYPE_BUDDY:
+		arena_lock(a, &a->lock);
+		*state = buddy_state(a, ptr, &x, &y);
+		arena_unlock(a, &a->lock);
+		break;
+	case ALLOCATOR_TYPE_NO_FREE: {
+		const size_t top = atomic_get(a, &a->nofree);
+		if (p >= m && (p - m) < top)
+			*state = ALLOCATOR_WALK_SPAN;
+		else if (p >= m && (p - m) == top && top < a->arena_len)
+			*state = ALLOCATOR_WALK_FREE;
+		break;
+	}
+	case ALLOCATOR_TYPE_CACHE: /* cached blocks are in use as far as the shared arena knows */
+		return a->cache.shared ? arena_state(a->cache.shared, ptr, state) : 0;
+	case ALLOCATOR_TYPE_MULTI: {
+		allocator_t *sub = multi_locate(a, ptr);
+		return sub ? arena_state(sub, ptr, state) : 0;
+	}
+	case ALLOCATOR_TYPE_FAIL: break;
+	}
+	return 0;
+}
+
+/* A pointer is valid if it is the start of a block, free or not, which is
+ * looked up per arena type without walking the arena. Any pointer into the
+ * allocated part of a NO_FREE arena is valid (and allocated) as object
+ * boundaries are not kept. */
+int allocator_is_ptr_valid(void *arena, void *ptr) {
+	arena_validate(arena);
+	int state = -1;
+	const int r = arena_state(arena, ptr, &state);
+	return r < 0 ? r : state >= 0;
+}
+
+int allocator_is_ptr_allocated(void *arena, void *ptr) {
+	arena_validate(arena);
+	int state = -1;
+	const int r = arena_state(arena, ptr, &state);
+	return r < 0 ? r : state == ALLOCATOR_WALK_USED || state == ALLOCATOR_WALK_SPAN;
+}
+
+static int walk_fragmentation(void *param, void *ptr, size_t size, int state) {
+	allocator_fragmentation_t *f = param;
+	UNUSED(ptr);
+	if (state != ALLOCATOR_WALK_FREE) {
+		f->used_blocks++;
+		f->used += size;
+		return 0;
+	}
+	f->free_blocks++;
+	f->free += size;
+	f->largest = size > f->largest ? size : f->largest;
+	if (size)
+		f->histogram[bit_fls(size)]++;
+	return 0;
+}
+
+int allocator_get_fragmentation(void *arena, allocator_fragmentation_t *frag) {
+	arena_validate(arena);
+	check(frag);
+	memset(frag, 0, sizeof (*frag));
+	const int r = allocator_walk(arena, walk_fragmentation, frag);
+	if (r < 0)
+		return r;
+	if (frag->free)
+		frag->fragmentation = (size_t)(((unsigned long long)(frag->free - frag->largest) * 1000ull) / frag->free);
+	return 0;
+}
+
+/* All statistics are derived from counters maintained on the allocation
+ * path, so they can be polled cheaply, no lists are walked. */
+static inline size_t arena_used(allocator_t *a) {
+	switch (a->type) {
+	case ALLOCATOR_TYPE_NO_FREE: return atomic_get(a, &a->nofree);
+	case ALLOCATOR_TYPE_LIST: {
+		const size_t live = a->counts.allocs - a->counts.frees - a->list.sized; /* objects with headers */
+		return (a->list.end - a->list.start) - a->list.free - (live * LIST_HDR) - a->list.slab_bytes + a->list.slab_used;
+	}
+	case ALLOCATOR_TYPE_POOL: return atomic_get(a, &a->pool.used);
+	case ALLOCATOR_TYPE_BUDDY: return a->buddy.used;
+	case ALLOCATOR_TYPE_CACHE: return a->cache.used;
+	}
+	return 0;
+}
+
+static void arena_stats(allocator_t *a, allocator_stats_t *s) {
+	check(a);
+	check(s);
+	memset(s, 0, sizeof (*s));
+	s->total    = a->arena_len;
+	s->allocs   = atomic_get(a, &a->counts.allocs);
+	s->frees    = atomic_get(a, &a->counts.frees);
+	s->reallocs = atomic_get(a, &a->counts.reallocs);
+	if (a->type == ALLOCATOR_TYPE_MULTI) { /* sizes come from the sub-arenas */
+		multi_stats(a, s);
+		s->overhead = s->total >= (s->used + s->free) ? s->total - s->used - s->free : 0;
+		return;
+	}
+	if (a->type == ALLOCATOR_TYPE_CACHE) { /* the arena only holds magazines, blocks are in the shared arena */
+		s->used = a->cache.used;
+		s->free = cache_held(a);
+		s->peak = atomic_get(a, &a->counts.peak);
+		if (a->cache.shared)
+			(void)allocator_get_max_allocatable(a->cache.shared, &s->largest);
+		return;
+	}
+	s->used     = arena_used(a);
+	switch (a->type) {
+	case ALLOCATOR_TYPE_NO_FREE: {
+		s->used = atomic_get(a, &a->nofree);
+		s->free = a->arena_len - s->used;
+		const size_t next = alignup(s->used);
+		s->largest = next < a->arena_len ? a->arena_len - next : 0;
+		break;
+	}
+	case ALLOCATOR_TYPE_LIST:
+		s->free = a->list.free;
+		s->largest = list_largest(a);
+		break;
+	case ALLOCATOR_TYPE_POOL:
+		s->free = atomic_get(a, &a->pool.free);
+		s->largest = pool_largest(a);
+		break;
+	case ALLOCATOR_TYPE_BUDDY:
+		s->free = a->buddy.free;
+		s->largest = buddy_largest(a);
+		break;
+	case ALLOCATOR_TYPE_FAIL: break;
+	}
+	implies(!threaded(a), s->total >= (s->used + s->free));
+	s->overhead = s->total >= (s->used + s->free) ? s->total - s->used - s->free : 0;
+	s->peak = atomic_get(a, &a->counts.peak);
+}
+
+int allocator_get_stats(void *arena, allocator_stats_t *stats) {
+	arena_validate(arena);
+	check(stats);
+	allocator_t *a = arena;
+	if (a->error < 0)
+		return a->error;
+	arena_lock(a, &a->lock);
+	arena_stats(a, stats);
+	arena_unlock(a, &a->lock);
+	return 0;
+}
+
+int allocator_get_max_allocatable(void *arena, size_t *size) {
+	check(size);
+	allocator_stats_t s = { .largest = 0, };
+	const int r = allocator_get_stats(arena, &s);
+	*size = s.largest;
+	return r;
+}
+
+int allocator_get_overhead(void *arena, size_t *size) {
+	check(size);
+	allocator_stats_t s = { .overhead = 0, };
+	const int r = allocator_get_stats(arena, &s);
+	*size = s.overhead;
+	return r;
+}
+
+int allocator_get_free(void *arena, size_t *size) {
+	check(size);
+	allocator_stats_t s = { .free = 0, };
+	const int r = allocator_get_stats(arena, &s);
+	*size = s.free;
+	return r;
+}
+
+int allocator_get_total(void *arena, size_t *size) {
+	check(size);
+	allocator_stats_t s = { .total = 0, };
+	const int r = allocator_get_stats(arena, &s);
+	*size = s.total;
+	return r;
+}
+
+int allocator_mark(void *arena, size_t *mark) {
+	arena_validate(arena);
+	check(mark);
+	allocator_t *a = arena;
+	*mark = 0;
+	if (a->error < 0)
+		return a->error;
+	if (a->type != ALLOCATOR_TYPE_NO_FREE)
+		return -1;
+	*mark = atomic_get(a, &a->nofree);
+	return 0;
+}
+
+int allocator_rewind(void *arena, size_t mark) {
+	arena_validate(arena);
+	allocator_t *a = arena;
+	if (a->error < 0)
+		return a->error;
+	if (a->type != ALLOCATOR_TYPE_NO_FREE)
+		return -1;
+	for (;;) {
+		const size_t top = atomic_get(a, &a->nofree);
+		if (mark > top)
+			return -1;
+		if (atomic_cas(a, &a->nofree, top, mark)) {
+			if (!threaded(a)) /* another thread could already be using it */
+				arena_decommit(a, (uintptr_t)&arena_mem(a)[alignup(mark)], (uintptr_t)&arena_mem(a)[top]);
+			return 0;
+		}
+	}
+}
+
+int allocator_flush(void *arena) {
+	arena_validate(arena);
+	allocator_t *a = arena;
+	if (a->error < 0)
+		return a->error;
+	if (a->type == ALLOCATOR_TYPE_CACHE && a->cache.shared)
+		for (size_t i = 0; i < ALLOCATOR_CACHE_CLASSES; i++)
+			cache_drain(a, i, 0);
+	return 0;
+}
+
+int allocator_set_trace(void *arena, allocator_trace_fn trace, void *param) {
+	arena_validate(arena);
+	allocator_t *a = arena;
+	if (a->error < 0)
+		return a->error;
+	a->trace = trace;
+	a->trace_param = param;
+	return 0;
+}
+
+/* Events are passed to the record callback as they happen, after the call
+ * they describe has completed and outside of any lock, so a callback shared
+ * by threads must do its own locking. 'allocator_event_encode' packs an event
+ * into a few bytes (each field as a base 128 varint) for writing out. */
+int allocator_set_record(void *arena, allocator_record_fn record, void *param) {
+	arena_validate(arena);
+	allocator_t *a = arena;
+	if (a->error < 0)
+		return a->error;
+	a->record = record;
+	a->record_param = param;
+	return 0;
+}
+
+static unsigned long long arena_clock(void) {
+#if ALLOCATOR_CLOCK
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return ((unsigned long long)ts.tv_sec * 1000000000ull) + (unsigned long long)ts.tv_nsec;
+#else
+	return 0;
+#endif
+}
+
+static void arena_record(allocator_t *a, int op, void *ptr, size_t oldsz, size_t newsz, void *r) {
+	const allocator_event_t e = {
+		.op = op,
+		.thread = thread_slot(),
+		.time = arena_clock(),
+		.old = (uintptr_t)ptr,
+		.ptr = (uintptr_t)r,
+		.oldsz = oldsz,
+		.size = newsz,
+	};
+	if (a->record(a->record_param, &e) < 0)
+		a->error = -1;
+}
+
+static size_t varint_encode(unsigned long long v, unsigned char *buf, size_t len) {
+	size_t i = 0;
+	for (; i < len; i++, v >>= 7) {
+		buf[i] = (v & 0x7Fu) | (v > 0x7Fu ? 0x80u : 0u);
+		if (v <= 0x7Fu)
+			return i + 1u;
+	}
+	return 0;
+}
+
+static size_t varint_decode(unsigned long long *v, const unsigned char *buf, size_t len) {
+	*v = 0;
+	for (size_t i = 0, shift = 0; i < len && shift < 64u; i++, shift += 7u) {
+		*v |= (unsigned long long)(buf[i] & 0x7Fu) << shift;
+		if (!(buf[i] & 0x80u))
+			return i + 1u;
+	}
+	return 0;
+}
+
+size_t allocator_event_encode(const allocator_event_t *event, unsigned char *buf, size_t len) {
+	check(event);
+	check(buf);
+	const unsigned long long fields[] = { event->op, event->thread, event->time, event->old, event->ptr, event->oldsz, event->size, };
+	size_t n = 0;
+	for (size_t i = 0; i < (sizeof (fields) / sizeof (fields[0])); i++) {
+		const size_t r = varint_encode(fields[i], &buf[n], len - n);
+		if (r == 0)
+			return 0;
+		n += r;
+	}
+	return n;
+}
+
+size_t allocator_event_decode(allocator_event_t *event, const unsigned char *buf, size_t len) {
+	check(event);
+	check(buf);
+	unsigned long long fields[7] = { 0, };
+	size_t n = 0;
+	for (size_t i = 0; i < (sizeof (fields) / sizeof (fields[0])); i++) {
+		const size_t r = varint_decode(&fields[i], &buf[n], len - n);
+		if (r == 0)
+			return 0;
+		n += r;
+	}
+	if (fields[0] < ALLOCATOR_EVENT_ALLOC || fields[0] > ALLOCATOR_EVENT_ALIGNED || fields[5] > SIZE_MAX || fields[6] > SIZE_MAX)
+		return 0;
+	event->op = (int)fields[0];
+	event->thread = (unsigned long)fields[1];
+	event->time = fields[2];
+	event->old = fields[3];
+	event->ptr = fields[4];
+	event->oldsz = (size_t)fields[5];
+	event->size = (size_t)fields[6];
+	return n;
+}
+
+/* Open addressing hash tables, with linear probing, of 'entries' entries of
+ * 'stride' bytes keyed by their first member, an 'unsigned long long' that is
+ * zero in empty entries. Removal shifts later entries back, no tombstones. */
+static inline unsigned long long *table_key(void *table, size_t stride, size_t i) {
+	return (unsigned long long*)((unsigned char*)table + (i * stride));
+}
+
+static inline size_t table_home(unsigned long long key, size_t entries) {
+	return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32) % entries;
+}
+
+static void *table_find(void *table, size_t stride, size_t entries, unsigned long long key) { /* entry, or empty entry for it */
+	size_t i = table_home(key, entries);
+	for (size_t probes = 0; probes < entries; probes++, i = (i + 1u) % entries) {
+		unsigned long long *k = table_key(table, stride, i);
+		if (*k == key || *k == 0)
+			return k;
+	}
+	return NULL;
+}
+
+static void table_remove(void *table, size_t stride, size_t entries, void *entry) {
+	size_t hole = ((unsigned char*)entry - (unsigned char*)table) / stride;
+	*table_key(table, stride, hole) = 0;
+	for (size_t i = (hole + 1u) % entries; *table_key(table, stride, i); i = (i + 1u) % entries) {
+		const size_t home = table_home(*table_key(table, stride, i), entries);
+		if (((i - home + entries) % entries) >= ((i - hole + entries) % entries)) {
+			memcpy(table_key(table, stride, hole), table_key(table, stride, i), stride);
+			*table_key(table, stride, i) = 0;
+			hole = i;
+		}
+	}
+}
+
+/* Replay a recorded trace against an arena in the order it was recorded,
+ * whichever threads made the calls, ignoring the timestamps. 'map' (of
+ * 'entries' zeroed entries, more than the most objects ever live at once)
+ * tracks which allocation in this arena stands in for each address in the
+ * trace. Calls on addresses allocated before recording started are skipped.
+ * This returns the number of requests that succeeded when recorded but
+ * failed when replayed, or -1 if the trace is malformed or the map full. */
+int allocator_replay(void *arena, const unsigned char *trace, size_t len, allocator_replay_t *map, size_t entries) {
+	arena_validate(arena);
+	check(trace || len == 0);
+	check(map);
+	int fails = 0;
+	if (entries == 0)
+		return -1;
+	for (size_t n = 0; n < len;) {
+		allocator_event_t e;
+		const size_t r = allocator_event_decode(&e, &trace[n], len - n);
+		if (r == 0)
+			return -1;
+		n += r;
+		allocator_replay_t *m = e.old ? table_find(map, sizeof (*map), entries, e.old) : NULL;
+		if (e.old && (!m || !m->recorded))
+			continue; /* allocated before recording started */
+		void *p = NULL;
+		switch (e.op) {
+		case ALLOCATOR_EVENT_FREE:
+			if (!m)
+				return -1;
+			(void)allocator(arena, m->replayed, e.oldsz, 0);
+			table_remove(map, sizeof (*map), entries, m);
+			continue;
+		case ALLOCATOR_EVENT_REALLOC:
+			if (!m)
+				return -1;
+			if (!(p = allocator(arena, m->replayed, e.oldsz, e.size))) {
+				fails += e.ptr != 0;
+				continue;
+			}
+			if (!e.ptr) { /* failed when recorded, the original is still in use */
+				m->replayed = p;
+				continue;
+			}
+			table_remove(map, sizeof (*map), entries, m);
+			break;
+		default:
+			p = e.op == ALLOCATOR_EVENT_ALIGNED ? allocator_aligned(arena, e.size, e.oldsz) : allocator(arena, NULL, 0, e.size);
+			if (!p) {
+				fails += e.ptr != 0;
+				continue;
+			}
+			if (!e.ptr) { /* failed when recorded, so the caller never had it */
+				(void)allocator(arena, p, e.size, 0);
+				continue;
+			}
+		}
+		if (!(m = table_find(map, sizeof (*map), entries, e.ptr)))
+			return -1;
+		m->recorded = e.ptr;
+		m->replayed = p;
+	}
+	return fails;
+}
+
+/* A free that fails kills the arena, so it is only counted if the arena
+ * is still alive. */
+static inline void arena_account(allocator_t *a, void *ptr, size_t oldsz, size_t newsz, void *r) {
+	if (ptr && newsz == 0) {
+		if (a->error >= 0)
+			atomic_add(a, &a->counts.frees, 1);
+	} else if (r) {
+		atomic_add(a, ptr ? &a->counts.reallocs : &a->counts.allocs, 1);
+		if (newsz > oldsz || !ptr) /* only growth can raise the high water mark */
+			atomic_max(a, &a->counts.peak, arena_used(a));
+	}
+}
+
+/* The type is passed separately so that it folds to a constant when this is
+ * inlined into an allocation function for a single arena type. */
+static inline void *arena_typed(allocator_t *a, const int type, void *ptr, size_t oldsz, size_t newsz) {
+	void *r = NULL;
+	switch (type) {
+	case ALLOCATOR_TYPE_NO_FREE:
+		if (ptr && newsz == 0) { /* only the top allocation is released, so only it is counted */
+			if (nofree_free(a, ptr, oldsz) == 0)
+				arena_account(a, ptr, oldsz, newsz, r);
+			return NULL;
+		}
+		r = nofree_allocator(a, ptr, oldsz, newsz);
+		arena_account(a, ptr, oldsz, newsz, r);
+		break;
+	case ALLOCATOR_TYPE_FAIL: return NULL;
+	case ALLOCATOR_TYPE_MULTI: /* the sub-arenas zero memory themselves */
+		r = multi_allocator(a, ptr, oldsz, newsz);
+		arena_account(a, ptr, oldsz, newsz, r);
+		return r;
+	case ALLOCATOR_TYPE_LIST:
+		arena_lock(a, &a->lock);
+		r = list_allocator(a, ptr, oldsz, newsz);
+		arena_account(a, ptr, oldsz, newsz, r);
+		arena_unlock(a, &a->lock);
+		break;
+	case ALLOCATOR_TYPE_POOL:
+		r = pool_allocator(a, ptr, oldsz, newsz);
+		arena_account(a, ptr, oldsz, newsz, r);
+		break;
+	case ALLOCATOR_TYPE_BUDDY:
+		arena_lock(a, &a->lock);
+		r = buddy_allocator(a, ptr, newsz);
+		arena_account(a, ptr, oldsz, newsz, r);
+		arena_unlock(a, &a->lock);
+		break;
+	case ALLOCATOR_TYPE_CACHE:
+		r = cache_allocator(a, ptr, oldsz, newsz);
+		arena_account(a, ptr, oldsz, newsz, r);
+		break;
+	}
+	if (r && (a->flags & ALLOCATOR_FLAG_ZERO)) {
+		const size_t old = ptr ? oldsz : 0;
+		if (newsz > old)
+			memset((unsigned char*)r + old, 0, newsz - old);
+	}
+	return r;
+}
+
+static void *arena_dispatch(allocator_t *a, void *ptr, size_t oldsz, size_t newsz) {
+	return arena_typed(a, a->type, ptr, oldsz, newsz);
+}
+
+/* The profiler samples allocations at an average of one every 'interval'
+ * bytes, the gap to the next sample being drawn from an exponential
+ * distribution (as tcmalloc does) so that it cannot fall into step with the
+ * program. A sample stands for 'interval' bytes, or its size if larger, and
+ * is charged to a site, the tag the calling thread set or the address
+ * 'allocator' was called from, until it is freed. All of its state lives in
+ * the buffer handed to 'allocator_set_profile', a table of sites followed by
+ * a table of live samples; samples are dropped if either table is full. */
+typedef struct {
+	unsigned long long site; /* tag or caller, one if unknown */
+	int tagged;
+	size_t bytes, objects;
+} profile_site_t;
+
+typedef struct {
+	unsigned long long ptr; /* sampled allocation */
+	profile_site_t *site;
+	size_t bytes, objects;  /* what the sample stands for */
+} profile_sample_t;
+
+typedef struct profile {
+	int lock;
+	size_t interval, countdown;
+	unsigned long long seed;
+	size_t sites, samples, live; /* table sizes, and samples in the table */
+	profile_site_t *site;
+	profile_sample_t *sample;
+} profile_t;
+
+#if ALLOCATOR_ATOMICS
+static __thread const char *profile_tag;
+#else
+static const char *profile_tag;
+#endif
+
+/* Tag this thread's allocations, returning the previous tag so they can nest */
+const char *allocator_profile_tag(const char *tag) {
+	const char *r = profile_tag;
+	profile_tag = tag;
+	return r;
+}
+
+static size_t profile_gap(profile_t *p) { /* exponential with mean 'interval' */
+	p->seed ^= p->seed << 13;
+	p->seed ^= p->seed >> 7;
+	p->seed ^= p->seed << 17;
+	const size_t r = (size_t)(p->seed >> 32) | 1u, f = bit_fls(r); /* 'u = r / 2^32' in (0, 1) */
+	const unsigned long long log2r = ((unsigned long long)f << 16) | ((((unsigned long long)r << (31u - f)) & 0x7FFFFFFFull) >> 15); /* 16.16, linear between powers of two */
+	const unsigned long long ln = (((32ull << 16) - log2r) * 45426ull) >> 16; /* '-ln(u) = ln(2) * (32 - log2(r))', ln(2) is 45426 in 16.16 */
+	return (size_t)(((p->interval >> 16) * ln) + (((p->interval & 0xFFFFu) * ln) >> 16)) + 1u;
+}
+
+/* 'buf' must be aligned, a zero 'interval' turns the profiler off */
+int allocator_set_profile(void *arena, size_t interval, void *buf, size_t len) {
+	arena_validate(arena);
+	allocator_t *a = arena;
+	if (a->error < 0)
+		return a->error;
+	a->profile = NULL;
+	if (interval == 0)
+		return 0;
+	const size_t hdr = alignup(sizeof (profile_t)), unit = sizeof (profile_site_t) + (4u * sizeof (profile_sample_t));
+	if (!buf || ((uintptr_t)buf & ALIGN_MASK) || len < (hdr + unit))
+		return -1;
+	memset(buf, 0, len);
+	profile_t *p = buf;
+	p->interval = interval;
+	p->seed = 0x9E3779B97F4A7C15ull;
+	p->sites = (len - hdr) / unit;
+	p->samples = p->sites * 4u;
+	p->site = (profile_site_t*)((unsigned char*)buf + hdr);
+	p->sample = (profile_sample_t*)&p->site[p->sites];
+	p->countdown = profile_gap(p);
+	a->profile = p;
+	return 0;
+}
+
+static void profile_update(allocator_t *a, void *ptr, size_t newsz, void *r, const void *caller) {
+	profile_t *p = a->profile;
+	if (!r && (!ptr || newsz)) /* nothing allocated or freed */
+		return;
+	arena_lock(a, &p->lock);
+	profile_sample_t *s = ptr ? table_find(p->sample, sizeof (*s), p->samples, (uintptr_t)ptr) : NULL;
+	if (s && s->ptr) {
+		s->site->bytes -= s->bytes;
+		s->site->objects -= s->objects;
+		table_remove(p->sample, sizeof (*s), p->samples, s);
+		p->live--;
+	}
+	if (r && newsz > (p->countdown - 1u)) {
+		const char *tag = profile_tag;
+		const unsigned long long key = tag ? (uintptr_t)tag : caller ? (uintptr_t)caller : 1u;
+		profile_site_t *site = table_find(p->site, sizeof (*site), p->sites, key);
+		s = table_find(p->sample, sizeof (*s), p->samples, (uintptr_t)r);
+		p->countdown = profile_gap(p);
+		if (site && s && (p->live * 4u) < (p->samples * 3u)) {
+			site->site = key;
+			site->tagged = !!tag;
+			s->ptr = (uintptr_t)r;
+			s->site = site;
+			s->bytes = newsz > p->interval ? newsz : p->interval;
+			s->objects = s->bytes / newsz;
+			site->bytes += s->bytes;
+			site->objects += s->objects;
+			p->live++;
+		}
+	} else if (r) {
+		p->countdown -= newsz;
+	}
+	arena_unlock(a, &p->lock);
+}
+
+/* Fill 'sites' with up to 'count' sites with the most live bytes, largest
+ * first, returning the number filled in (or a negative error). */
+int allocator_get_profile(void *arena, allocator_site_t *sites, size_t count) {
+	arena_validate(arena);
+	check(sites || count == 0);
+	allocator_t *a = arena;
+	if (a->error < 0)
+		return a->error;
+	profile_t *p = a->profile;
+	size_t n = 0;
+	if (!p)
+		return 0;
+	arena_lock(a, &p->lock);
+	for (size_t i = 0; i < p->sites; i++) {
+		const profile_site_t *s = &p->site[i];
+		if (!s->site || !s->bytes)
+			continue;
+		size_t j = n < count ? n++ : count; /* insertion sort of the top 'count' */
+		for (; j && sites[j - 1].bytes < s->bytes; j--)
+			if (j < count)
+				sites[j] = sites[j - 1];
+		if (j < count)
+			sites[j] = (allocator_site_t) { .site = s->site == 1u ? NULL : (const void*)(uintptr_t)s->site, .tagged = s->tagged, .bytes = s->bytes, .objects = s->objects, };
+	}
+	arena_unlock(a, &p->lock);
+	return (int)n;
+}
+
+/* Other threads only push frees onto the remote list, they do not touch the
+ * trace or profile, the owner records and profiles those frees as it drains
+ * them. */
+static void *owned_allocator(allocator_t *a, void *ptr, size_t oldsz, size_t newsz) {
+	if (a->owner != thread_id()) {
+		if (ptr && newsz == 0 && a->type != ALLOCATOR_TYPE_NO_FREE)
+			remote_push(a, ptr, oldsz);
+		return NULL;
+	}
+	for (remote_t *r = remote_take(a), *n = NULL; r; r = n) {
+		const size_t size = r->size;
+		n = remote_at(a, r->next);
+		(void)arena_dispatch(a, r, size, 0);
+		if (a->record)
+			arena_record(a, ALLOCATOR_EVENT_FREE, r, size, 0, NULL);
+		if (a->profile)
+			profile_update(a, r, 0, NULL, NULL);
+	}
+	return arena_dispatch(a, ptr, oldsz, newsz);
+}
+
+static void *arena_call(allocator_t *a, void *ptr, size_t oldsz, size_t newsz, const void *caller) {
+	if (a->error < 0)
+		return NULL;
+	if (a->owner && a->owner != thread_id())
+		return owned_allocator(a, ptr, oldsz, newsz);
+	void *r = a->owner ? owned_allocator(a, ptr, oldsz, newsz) : arena_dispatch(a, ptr, oldsz, newsz);
+	if (a->record && (ptr || newsz))
+		arena_record(a, !ptr ? ALLOCATOR_EVENT_ALLOC : newsz ? ALLOCATOR_EVENT_REALLOC : ALLOCATOR_EVENT_FREE, ptr, oldsz, newsz, r);
+	if (a->profile)
+		profile_update(a, ptr, newsz, r, caller);
+	return r;
+}
+
+void *allocator(void *arena, void *ptr, size_t oldsz, size_t newsz) {
+	arena_validate(arena);
+	return arena_call(arena, ptr, oldsz, newsz, CALLER);
+}
+
+/* Allocation functions for a single arena type skip 'arena_validate' and the
+ * dispatch on the type, which for a bump allocator cost more than allocating
+ * does. Arenas of any other type, or with an owner, or being recorded or
+ * profiled, take the same path as 'allocator'. */
+#define ARENA_TYPED(NAME, TYPE)\
+	void *NAME(void *arena, void *ptr, size_t oldsz, size_t newsz) {\
+		allocator_t *a = arena;\
+		check(a && a->magic == ARENA_MAGIC);\
+		if (a->type != (TYPE) || a->owner || a->record || a->profile)\
+			return arena_call(a, ptr, oldsz, newsz, CALLER);\
+		return a->error < 0 ? NULL : arena_typed(a, (TYPE), ptr, oldsz, newsz);\
+	}
+
+ARENA_TYPED(allocator_list,    ALLOCATOR_TYPE_LIST)
+ARENA_TYPED(allocator_no_free, ALLOCATOR_TYPE_NO_FREE)
+ARENA_TYPED(allocator_pool,    ALLOCATOR_TYPE_POOL)
+ARENA_TYPED(allocator_buddy,   ALLOCATOR_TYPE_BUDDY)
+ARENA_TYPED(allocator_cache,   ALLOCATOR_TYPE_CACHE)
+ARENA_TYPED(allocator_multi,   ALLOCATOR_TYPE_MULTI)
+
+int allocator_set_owner(void *arena, int owned) {
+	arena_validate(arena);
+	allocator_t *a = arena;
+	BUILD_BUG_ON(sizeof (remote_t) > POOL_MIN);
+	BUILD_BUG_ON(sizeof (remote_t) > sizeof (lfree_t));
+	if (a->error < 0)
+		return a->error;
+	if (!ALLOCATOR_ATOMICS)
+		return -1;
+	if (!owned) {
+		if (a->owner && a->owner != thread_id())
+			return -1;
+		(void)owned_allocator(a, NULL, 0, 0); /* drain remote frees */
+		a->owner = 0;
+		return 0;
+	}
+	a->owner = thread_id();
+	return 0;
+}
+
+static void *arena_aligned(allocator_t *a, size_t size, size_t align) {
+	if ((a->flags & ALLOCATOR_FLAG_SIZED) && a->type == ALLOCATOR_TYPE_LIST && size <= ALLOCATOR_SLAB_MAX)
+		return NULL; /* slab slots are not aligned, and a larger block would be freed as one */
+	if (a->owner && a->owner != thread_id())
+		return NULL;
+	void *r = NULL;
+	switch (a->type) {
+	case ALLOCATOR_TYPE_NO_FREE: r = nofree_aligned(a, size, align); break;
+	case ALLOCATOR_TYPE_LIST:
+		arena_lock(a, &a->lock);
+		r = list_aligned(a, size, align);
+		arena_account(a, NULL, 0, size, r);
+		arena_unlock(a, &a->lock);
+		break;
+	case ALLOCATOR_TYPE_POOL: r = pool_aligned(a, size, align); break;
+	case ALLOCATOR_TYPE_BUDDY:
+		arena_lock(a, &a->lock);
+		r = buddy_aligned(a, size, align);
+		arena_account(a, NULL, 0, size, r);
+		arena_unlock(a, &a->lock);
+		break;
+	case ALLOCATOR_TYPE_CACHE: { /* must be big enough to be cached when freed, and counted as 'cache_free' will */
+		const size_t n = size <= CACHE_MAX ? pool_class_size(pool_class(size)) : size;
+		if (a->cache.shared && (r = allocator_aligned(a->cache.shared, n, align)))
+			a->cache.used += n;
+		break;
+	}
+	case ALLOCATOR_TYPE_MULTI:
+		if (a->multi.count)
+			r = multi_malloc(a, size, align);
+		arena_account(a, NULL, 0, size, r);
+		return r;
+	case ALLOCATOR_TYPE_FAIL: return NULL;
+	}
+	if (a->type != ALLOCATOR_TYPE_LIST && a->type != ALLOCATOR_TYPE_BUDDY)
+		arena_account(a, NULL, 0, size, r);
+	if (r && (a->flags & ALLOCATOR_FLAG_ZERO))
+		memset(r, 0, size);
+	return r;
+}
+
+/* Alignments up to ALLOCATOR_ALIGNMENT are met by 'allocator' itself, blocks
+ * are freed as normal, but reallocation only keeps ALLOCATOR_ALIGNMENT. */
+static void *aligned_call(allocator_t *a, size_t size, size_t align, const void *caller) {
+	if (a->error < 0 || size == 0 || align == 0 || (align & (align - 1u)))
+		return NULL;
+	if (a->owner && a->owner != thread_id())
+		return NULL;
+	if (align <= ALLOCATOR_ALIGNMENT)
+		return arena_call(a, NULL, 0, size, caller);
+	void *r = arena_aligned(a, size, align);
+	if (a->record)
+		arena_record(a, ALLOCATOR_EVENT_ALIGNED, NULL, align, size, r);
+	if (a->profile)
+		profile_update(a, NULL, size, r, caller);
+	return r;
+}
+
+void *allocator_aligned(void *arena, size_t size, size_t align) {
+	arena_validate(arena);
+	return aligned_call(arena, size, align, CALLER);
+}
+
+/* As 'allocator_aligned', but only for an arena of type 'type', this is what
+ * an aligned ALLOCATOR_DECLARE calls so the arena is validated once. */
+void *allocator_aligned_typed(void *arena, int type, size_t size, size_t align) {
+	arena_validate(arena);
+	allocator_t *a = arena;
+	return a->type == type ? aligned_call(a, size, align, CALLER) : NULL;
+}
+
+/* Batches validate the arena once and take the list lock once, the pool
+ * allocator goes further and updates each bitmap unit once. All of the
+ * allocations succeed or none do. Arenas of other types, or ones with an
+ * owner or being recorded or profiled, fall back to calling 'allocator' for each object. */
+int allocator_alloc_batch(void *arena, size_t size, size_t count, void **ptrs) {
+	arena_validate(arena);
+	check(ptrs);
+	allocator_t *a = arena;
+	if (a->error < 0)
+		return a->error;
+	if (size == 0)
+		return -1;
+	size_t n = 0;
+	if (a->owner || a->record || a->profile || (a->flags & ALLOCATOR_FLAG_SIZED) || (a->type != ALLOCATOR_TYPE_LIST && a->type != ALLOCATOR_TYPE_POOL)) {
+		for (; n < count && (ptrs[n] = arena_call(a, NULL, 0, size, CALLER)); n++)
+			;
+	} else {
+		if (a->type == ALLOCATOR_TYPE_LIST) {
+			arena_lock(a, &a->lock);
+			for (; n < count && (ptrs[n] = list_malloc(a, size)); n++)
+				;
+		} else {
+			n = pool_malloc_batch(a, size, count, ptrs);
+		}
+		atomic_add(a, &a->counts.allocs, n);
+		atomic_max(a, &a->counts.peak, arena_used(a));
+		if (a->type == ALLOCATOR_TYPE_LIST)
+			arena_unlock(a, &a->lock);
+		if (a->flags & ALLOCATOR_FLAG_ZERO)
+			for (size_t i = 0; i < n; i++)
+				memset(ptrs[i], 0, size);
+	}
+	if (n == count)
+		return 0;
+	for (size_t i = 0; i < n; i++) {
+		(void)allocator(arena, ptrs[i], size, 0);
+		ptrs[i] = NULL;
+	}
+	return -1;
+}
+
+/* 'sizes' may be NULL for list and pool arenas, NULL pointers are skipped */
+static int arena_sized(allocator_t *a) { /* must frees be given the size? */
+	if (a->type == ALLOCATOR_TYPE_MULTI && a->multi.count)
+		return arena_sized(multi_sub(a, 0));
+	return a->type == ALLOCATOR_TYPE_CACHE || (a->flags & ALLOCATOR_FLAG_SIZED);
+}
+
+int allocator_free_batch(void *arena, void **ptrs, const size_t *sizes, size_t count) {
+	arena_validate(arena);
+	check(ptrs || count == 0);
+	allocator_t *a = arena;
+	if (a->error < 0)
+		return a->error;
+	if (!sizes && arena_sized(a))
+		return -1;
+	if (a->owner || a->record || a->profile || (a->flags & ALLOCATOR_FLAG_SIZED) || (a->type != ALLOCATOR_TYPE_LIST && a->type != ALLOCATOR_TYPE_POOL)) {
+		for (size_t i = 0; i < count; i++)
+			if (ptrs[i])
+				(void)arena_call(a, ptrs[i], sizes ? sizes[i] : 0, 0, CALLER);
+		return a->error;
+	}
+	size_t n = 0;
+	int r = 0;
+	if (a->type == ALLOCATOR_TYPE_POOL) {
+		r = pool_free_batch(a, ptrs, count, &n);
+		atomic_add(a, &a->counts.frees, n);
+		return r;
+	}
+	arena_lock(a, &a->lock); /* the counts are part of the list's used bytes */
+	for (size_t i = 0; i < count && r >= 0; i++)
+		if (ptrs[i] && (r = list_free(a, ptrs[i])) >= 0)
+			n++;
+	atomic_add(a, &a->counts.frees, n);
+	arena_unlock(a, &a->lock);
+	return r;
+}
+
+static int arena_attach(allocator_t *a) {
+	if (a->magic != ARENA_MAGIC || (a->pad + a->base + a->arena_len) != a->buf_len)
+		return -1;
+	switch (a->type) {
+	case ALLOCATOR_TYPE_LIST:
+	case ALLOCATOR_TYPE_NO_FREE:
+	case ALLOCATOR_TYPE_FAIL:
+	case ALLOCATOR_TYPE_POOL:
+	case ALLOCATOR_TYPE_BUDDY:
+	case ALLOCATOR_TYPE_MULTI:
+		break;
+	default: /* caches point into another arena */
+		return -1;
+	}
+	if (a->type == ALLOCATOR_TYPE_LIST && (a->flags & ALLOCATOR_FLAG_SIZED) && ((uintptr_t)arena_mem(a) % ALLOCATOR_SLAB_SIZE) != a->list.phase)
+		return -1; /* slabs are found by masking addresses */
+	a->trace = NULL;
+	a->trace_param = NULL;
+	a->record = NULL;
+	a->record_param = NULL;
+	a->profile = NULL;
+	a->lock = 0;
+	a->owner = 0;
+	for (size_t i = 0; i < ALLOCATOR_POOL_CLASSES; i++)
+		a->pool.classes[i].lock = 0;
+	if (a->type == ALLOCATOR_TYPE_MULTI)
+		for (size_t i = 0; i < a->multi.count; i++)
+			if (arena_attach(multi_sub(a, i)) < 0)
+				return -1;
+	for (remote_t *r = remote_take(a), *n = NULL; r; r = n) { /* left by a thread that has gone */
+		n = remote_at(a, r->next);
+		(void)arena_dispatch(a, r, r->size, 0);
+	}
+	return 0;
+}
+
+int allocator_attach(void **arena, unsigned char *buf, size_t len) {
+	check(arena);
+	check(buf);
+	*arena = NULL;
+	allocator_t *a = (allocator_t*)alignup((uintptr_t)buf);
+	if (len < ((sizeof (*a) + ALLOCATOR_ALIGNMENT) * 2ull))
+		return -1;
+	if (a->buf_len != len || a->pad != (size_t)((unsigned char*)a - buf))
+		return -1;
+	if (arena_attach(a) < 0)
+		return -1;
+	*arena = (void*)a;
+	return 0;
+}
+
+/* A file backed arena is a shared mapping of the whole file, which is
+ * formatted if it is empty or attached to if it is not. The file must not be
+ * mapped by more than one process at a time. */
+int allocator_open_file(void **arena, const char *file, int type, size_t len) {
+	check(arena);
+	check(file);
+	*arena = NULL;
+#if ALLOCATOR_MMAP
+	const int fd = open(file, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	int fresh = 0;
+	if (fstat(fd, &st) < 0)
+		goto fail;
+	fresh = st.st_size == 0;
+	if (!fresh)
+		len = st.st_size;
+	if (len == 0 || (fresh && ftruncate(fd, len) < 0))
+		goto fail;
+	unsigned char *m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED)
+		goto fail;
+	if ((fresh ? allocator_format(arena, type, m, len) : allocator_attach(arena, m, len)) < 0) {
+		(void)munmap(m, len);
+		goto fail;
+	}
+	(void)close(fd);
+	return 0;
+fail:
+	if (fresh)
+		(void)ftruncate(fd, 0);
+	(void)close(fd);
+	return -1;
+#else
+	UNUSED(type);
+	UNUSED(len);
+	return -1;
+#endif
+}
+
+int allocator_sync(void *arena) {
+	arena_validate(arena);
+	allocator_t *a = arena;
+	if (a->error < 0)
+		return a->error;
+#if ALLOCATOR_MMAP
+	return msync(arena_buf(a), a->buf_len, MS_SYNC) < 0 ? -1 : 0;
+#else
+	return -1;
+#endif
+}
+
+/* A virtual arena reserves address space without committing memory, pages
+ * are only backed when they are first touched, which the lazy format relies
+ * on. With ALLOCATOR_FLAG_HUGE the range is aligned to, and advised to use,
+ * transparent huge pages. Combine with ALLOCATOR_FLAG_RELEASE to hand free
+ * pages back. */
+int allocator_open_virtual(void **arena, int type, size_t len) {
+	check(arena);
+	*arena = NULL;
+#if ALLOCATOR_MMAP && (defined(MAP_ANONYMOUS) || defined(MAP_ANON))
+	const size_t huge = (type & ALLOCATOR_FLAG_HUGE) ? ALLOCATOR_HUGE_PAGE : ALLOCATOR_PAGE;
+	len = (len + huge - 1u) & ~(size_t)(huge - 1u);
+	if (len == 0 || (len + huge) < len)
+		return -1;
+#ifdef MAP_ANONYMOUS
+	int mflags = MAP_PRIVATE | MAP_ANONYMOUS;
+#else
+	int mflags = MAP_PRIVATE | MAP_ANON;
+#endif
+#ifdef MAP_NORESERVE
+	mflags |= MAP_NORESERVE;
+#endif
+	unsigned char *m = mmap(NULL, len + huge, PROT_READ | PROT_WRITE, mflags, -1, 0);
+	if (m == MAP_FAILED)
+		return -1;
+	unsigned char *buf = (unsigned char*)(((uintptr_t)m + huge - 1u) & ~(uintptr_t)(huge - 1u));
+	if (buf != m) /* trim so the range starts on a (huge) page boundary */
+		(void)munmap(m, buf - m);
+	(void)munmap(buf + len, (m + len + huge) - (buf + len));
+#ifdef MADV_HUGEPAGE
+	if (type & ALLOCATOR_FLAG_HUGE)
+		(void)madvise(buf, len, MADV_HUGEPAGE);
+#endif
+	if (allocator_format(arena, type, buf, len) < 0) {
+		(void)munmap(buf, len);
+		return -1;
+	}
+	return 0;
+#else
+	UNUSED(type);
+	UNUSED(len);
+	return -1;
+#endif
+}
+
+int allocator_close_virtual(void *arena) {
+	arena_validate(arena);
+	allocator_t *a = arena;
+#if ALLOCATOR_MMAP
+	return munmap(arena_buf(a), a->buf_len) < 0 ? -1 : 0;
+#else
+	UNUSED(a);
+	return -1;
+#endif
+}
+
+int allocator_close_file(void *arena) {
+	arena_validate(arena);
+	allocator_t *a = arena;
+#if ALLOCATOR_MMAP
+	const int r = allocator_sync(arena);
+	if (munmap(arena_buf(a), a->buf_len) < 0)
+		return -1;
+	return r;
+#else
+	UNUSED(a);
+	return -1;
+#endif
+}
+
+static int list_test(void) {
+	static unsigned char buf[1024 * 16];
+	void *arena = NULL, *p[32] = { NULL, };
+	if (allocator_format(&arena, ALLOCATOR_TYPE_LIST, buf, sizeof (buf)) < 0) return -1;
+	for (size_t i = 0; i < 32; i++) {
+		if (!(p[i] = allocator(arena, NULL, 0, (i * 7) + 1))) return -1;
+		if ((uintptr_t)p[i] & ALIGN_MASK) return -1;
+		memset(p[i], (int)i, (i * 7) + 1);
+	}
+	for (size_t i = 0; i < 32; i += 2)
+		if (allocator(arena, p[i], (i * 7) + 1, 0)) return -1;
+	if (!(p[1] = allocator(arena, p[1], 8, 1024))) return -1;
+	if (((unsigned char*)p[1])[7] != 1) return -1;
+	for (size_t i = 1; i < 32; i += 2)
+		allocator(arena, p[i], 0, 0);
+	void *big = allocator(arena, NULL, 0, sizeof (buf) / 2); /* everything coalesced? */
+	if (!big) return -1;
+	if (allocator(arena, NULL, 0, sizeof (buf))) return -1;
+	allocator(arena, big, sizeof (buf) / 2, 0);
+	void *r1 = allocator(arena, NULL, 0, 64), *r2 = allocator(arena, NULL, 0, 64);
+	if (!r1 || !r2) return -1;
+	if (allocator(arena, r1, 64, 32) != r1) return -1; /* shrink in place */
+	if (allocator(arena, r1, 32, 64) != r1) return -1; /* regrow into released tail */
+	allocator(arena, r2, 64, 0);
+	if (allocator(arena, r1, 64, 4096) != r1) return -1; /* grow into free neighbour */
+	allocator(arena, r1, 4096, 0);
+	void *q[3] = { NULL, };
+	for (size_t i = 0; i < 3; i++)
+		if (!(q[i] = allocator(arena, NULL, 0, 24))) return -1;
+	allocator(arena, q[1], 24, 0);
+	const size_t exact = (2 * list_adjust(24)) - LIST_HDR; /* takes all of the neighbour, nothing split off */
+	if (allocator(arena, q[0], 24, exact) != q[0]) return -1;
+	memset(q[0], 0, exact);
+	if (allocator_is_ptr_allocated(arena, q[0]) != 1 || allocator_is_ptr_allocated(arena, q[2]) != 1) return -1;
+	return 0;
+}
+
+static int nofree_test(void) {
+	static unsigned char buf[4096];
+	void *arena = NULL;
+	size_t mark = 0, mark2 = 0;
+	if (allocator_format(&arena, ALLOCATOR_TYPE_NO_FREE, buf, sizeof (buf)) < 0) return -1;
+	if (allocator_mark(arena, &mark) < 0) return -1;
+	unsigned char *p1 = allocator(arena, NULL, 0, 10), *p2 = allocator(arena, NULL, 0, 10);
+	if (!p1 || !p2 || p1 == p2) return -1;
+	if ((uintptr_t)p2 & ALIGN_MASK) return -1;
+	if (p1 < (unsigned char*)arena + sizeof (allocator_t)) return -1;
+	if (allocator(arena, p2, 10, 100) != p2) return -1; /* top grows in place */
+	if (allocator(arena, p2, 100, 0) != NULL) return -1; /* top is released */
+	if (allocator(arena, p1, 10, 50) != p1) return -1; /* previous allocation is now on top */
+	allocator_stats_t s;
+	if (allocator(arena, p2, 10, 0) || allocator_get_stats(arena, &s) < 0 || s.frees != 1) return -1; /* not on top, not freed */
+	if (allocator_mark(arena, &mark2) < 0) return -1;
+	if (!allocator(arena, NULL, 0, 200)) return -1;
+	if (allocator_rewind(arena, mark2) < 0) return -1;
+	if (allocator(arena, NULL, 0, 10) != p1 + alignup(50)) return -1;
+	if (allocator_rewind(arena, mark) < 0) return -1;
+	if (allocator(arena, NULL, 0, 10) != p1) return -1;
+	if (allocator_rewind(arena, sizeof (buf)) >= 0) return -1;
+	return 0;
+}
+
+static int lazy_test(void) {
+	static unsigned char buf[4096];
+	void *arena = NULL;
+	memset(buf, 0xA5, sizeof (buf));
+	if (allocator_format(&arena, ALLOCATOR_TYPE_LIST | ALLOCATOR_FLAG_ZERO, buf, sizeof (buf)) < 0) return -1;
+	if (buf[sizeof (buf) / 2] != 0xA5) return -1; /* format should only touch metadata */
+	unsigned char *p = allocator(arena, NULL, 0, 64);
+	if (!p) return -1;
+	for (size_t i = 0; i < 64; i++)
+		if (p[i]) return -1;
+	memset(p, 0xA5, 64);
+	if (!(p = allocator(arena, p, 32, 128))) return -1; /* growth is zeroed, old contents kept */
+	if (p[31] != 0xA5 || p[32] != 0 || p[127] != 0) return -1;
+	if (allocator_reformat(arena, ALLOCATOR_TYPE_NO_FREE | 0x4000) >= 0) return -1;
+	return 0;
+}
+
+static int stats_test(void) {
+	static unsigned char buf[4096];
+	void *arena = NULL;
+	allocator_stats_t s;
+	size_t total = 0, used = 0, largest = 0;
+	if (allocator_format(&arena, ALLOCATOR_TYPE_LIST, buf, sizeof (buf)) < 0) return -1;
+	if (allocator_get_total(arena, &total) < 0 || total == 0) return -1;
+	if (allocator_get_max_allocatable(arena, &largest) < 0) return -1;
+	void *p = allocator(arena, NULL, 0, largest);
+	if (!p) return -1;
+	if (allocator_get_stats(arena, &s) < 0) return -1;
+	if (s.used < largest || s.allocs != 1 || s.total != total) return -1;
+	if ((s.used + s.free + s.overhead) != s.total) return -1;
+	used = s.used;
+	allocator(arena, p, largest, 0);
+	if (allocator_get_stats(arena, &s) < 0) return -1;
+	if (s.used != 0 || s.frees != 1 || s.peak != used || s.largest != largest) return -1;
+	if (allocator_reformat(arena, ALLOCATOR_TYPE_NO_FREE) < 0) return -1;
+	if (!allocator(arena, NULL, 0, 100)) return -1;
+	if (allocator_get_stats(arena, &s) < 0 || s.used != 100 || s.free != (total - 100)) return -1;
+	return 0;
+}
+
+static int pool_test(void) {
+	static unsigned char buf[1024 * 16];
+	void *arena = NULL, *p[64] = { NULL, };
+	if (allocator_format(&arena, ALLOCATOR_TYPE_POOL, buf, sizeof (buf)) < 0) return -1;
+	for (size_t i = 0; i < 64; i++) {
+		if (!(p[i] = allocator(arena, NULL, 0, i + 1))) return -1;
+		if ((uintptr_t)p[i] & ALIGN_MASK) return -1;
+		memset(p[i], (int)i, i + 1);
+	}
+	for (size_t i = 0; i < 64; i++)
+		for (size_t j = 0; j <= i; j++)
+			if (((unsigned char*)p[i])[j] != i) return -1;
+	if (allocator(arena, p[0], 1, POOL_MIN) != p[0]) return -1; /* fits in same class */
+	void *q = allocator(arena, p[0], 1, POOL_MIN + 1);
+	if (!q || q == p[0] || ((unsigned char*)q)[0] != 0) return -1;
+	if (allocator(arena, NULL, 0, POOL_MIN) != p[0]) return -1; /* reuse freed block */
+	if (allocator(arena, NULL, 0, pool_class_size(ALLOCATOR_POOL_CLASSES))) return -1;
+	size_t n = 0;
+	while (allocator(arena, NULL, 0, 1)) /* smaller requests spill into larger classes */
+		n++;
+	allocator_stats_t s;
+	if (allocator_get_stats(arena, &s) < 0 || s.free || s.largest) return -1;
+	if (allocator(arena, q, POOL_MIN + 1, 0)) return -1;
+	if (!allocator(arena, NULL, 0, 1)) return -1;
+	return 0;
+}
+
+static int cache_test(void) {
+	static unsigned char shared[1024 * 16], local[4096];
+	void *arena = NULL, *cache = NULL, *p[ALLOCATOR_CACHE_DEPTH * 2] = { NULL, };
+	allocator_stats_t s;
+	if (allocator_format(&arena, ALLOCATOR_TYPE_LIST, shared, sizeof (shared)) < 0) return -1;
+	if (allocator_format_cache(&cache, arena, local, sizeof (local)) < 0) return -1;
+	if (!(p[0] = allocator(cache, NULL, 0, 24))) return -1;
+	if (allocator_get_stats(arena, &s) < 0 || s.allocs != CACHE_BATCH) return -1; /* refilled in a batch */
+	if (allocator(cache, p[0], 24, 32) != p[0]) return -1; /* same class */
+	allocator(cache, p[0], 32, 0);
+	if (allocator(cache, NULL, 0, 20) != p[0]) return -1; /* last freed is first reused */
+	for (size_t i = 1; i < (ALLOCATOR_CACHE_DEPTH * 2); i++)
+		if (!(p[i] = allocator(cache, NULL, 0, 17))) return -1;
+	void *big = allocator(cache, NULL, 0, CACHE_MAX + 1); /* bypasses cache */
+	if (!big || !(big = allocator(cache, big, CACHE_MAX + 1, CACHE_MAX * 2))) return -1;
+	for (size_t i = 0; i < (ALLOCATOR_CACHE_DEPTH * 2); i++)
+		allocator(cache, p[i], 17, 0);
+	if (allocator_get_stats(cache, &s) < 0 || s.used != CACHE_MAX * 2 || s.peak < (ALLOCATOR_CACHE_DEPTH * 2) * POOL_MIN * 2u) return -1;
+	allocator(cache, big, CACHE_MAX * 2, 0);
+	if (allocator_get_stats(cache, &s) < 0 || s.used || s.free == 0 || s.frees != s.allocs || s.largest == 0) return -1;
+	if (!(p[0] = allocator_aligned(cache, 40, 64)) || ((uintptr_t)p[0] & 63u)) return -1;
+	if (allocator_get_stats(cache, &s) < 0 || s.used != pool_class_size(pool_class(40))) return -1;
+	allocator(cache, p[0], 40, 0);
+	if (allocator_get_stats(cache, &s) < 0 || s.used || s.frees != s.allocs) return -1;
+	if (allocator_get_stats(arena, &s) < 0 || s.used == 0) return -1; /* cache holds some */
+	if (allocator_flush(cache) < 0) return -1;
+	if (allocator_get_stats(arena, &s) < 0 || s.used != 0) return -1;
+	if (allocator_format(&arena, ALLOCATOR_TYPE_LIST, shared, 4096) < 0) return -1; /* too small for a whole batch */
+	if (allocator_format_cache(&cache, arena, local, sizeof (local)) < 0) return -1;
+	if (!(p[0] = allocator(cache, NULL, 0, CACHE_MAX))) return -1;
+	if (allocator_get_stats(arena, &s) < 0 || s.used == 0 || s.used >= CACHE_BATCH * CACHE_MAX) return -1; /* a partial refill */
+	allocator(cache, p[0], CACHE_MAX, 0);
+	if (allocator_flush(cache) < 0 || allocator_get_stats(arena, &s) < 0 || s.used != 0) return -1;
+	return 0;
+}
+
+static int owner_count(void *param, const allocator_event_t *e) {
+	size_t *n = param;
+	n[e->op == ALLOCATOR_EVENT_FREE]++;
+	return 0;
+}
+
+static int owner_test(void) {
+	static unsigned char buf[1024 * 16];
+	static size_t prof[512];
+	void *arena = NULL;
+	allocator_stats_t s;
+	allocator_site_t site;
+	size_t events[2] = { 0, };
+	if (allocator_format(&arena, ALLOCATOR_TYPE_POOL, buf, sizeof (buf)) < 0) return -1;
+	if (allocator_set_owner(arena, 1) < 0)
+		return ALLOCATOR_ATOMICS ? -1 : 0;
+	if (allocator_set_record(arena, owner_count, events) < 0 || allocator_set_profile(arena, 1, prof, sizeof (prof)) < 0) return -1;
+	allocator_t *a = arena;
+	void *p = allocator(arena, NULL, 0, 32), *q = allocator(arena, NULL, 0, 64);
+	if (!p || !q) return -1;
+	const uintptr_t owner = a->owner;
+	a->owner = owner + 1; /* pretend to be another thread */
+	if (allocator(arena, NULL, 0, 32)) return -1;
+	allocator(arena, p, 32, 0);
+	allocator(arena, q, 64, 0);
+	if (allocator_get_stats(arena, &s) < 0 || s.frees != 0 || !a->remote) return -1;
+	if (events[0] != 2 || events[1] != 0) return -1; /* only the owner records */
+	a->owner = owner;
+	if (!(p = allocator(arena, NULL, 0, 16))) return -1; /* drains remote frees */
+	if (allocator_get_stats(arena, &s) < 0 || s.frees != 2 || a->remote) return -1;
+	if (events[0] != 3 || events[1] != 2) return -1;
+	allocator(arena, p, 16, 0);
+	if (allocator_get_profile(arena, &site, 1) != 0) return -1; /* every sample freed */
+	if (allocator_set_owner(arena, 0) < 0 || a->owner) return -1;
+	return 0;
+}
+
+static int multi_test(void) {
+	static unsigned char buf[1024 * 64];
+	void *arena = NULL, *p[64] = { NULL, };
+	if (allocator_format_multi(&arena, ALLOCATOR_TYPE_LIST, 0, buf, sizeof (buf)) >= 0) return -1;
+	if (allocator_format_multi(&arena, ALLOCATOR_TYPE_CACHE, 4, buf, sizeof (buf)) >= 0) return -1;
+	if (allocator_format_multi(&arena, ALLOCATOR_TYPE_LIST, 4, buf, sizeof (buf)) < 0) return -1;
+	allocator_t *a = arena;
+	unsigned char *q = allocator(arena, NULL, 0, 64);
+	if (!q) return -1;
+	memset(q, 7, 64);
+	size_t n = 0; /* fill the local sub-arena until allocations are stolen from another */
+	for (; n < 64; n++) {
+		if (!(p[n] = allocator(arena, NULL, 0, 1024))) return -1;
+		if (multi_locate(a, p[n]) != multi_locate(a, q))
+			break;
+	}
+	if (n++ == 64) return -1;
+	if (!(q = allocator(arena, q, 64, 4096))) return -1; /* moves out of the full sub-arena */
+	if (q[63] != 7) return -1;
+	allocator_stats_t s;
+	if (allocator_get_stats(arena, &s) < 0) return -1;
+	if (s.allocs != n + 1 || s.reallocs != 1 || s.used < ((n * 1024) + 4096)) return -1;
+	for (size_t i = 0; i < n; i++)
+		if (allocator(arena, p[i], 1024, 0)) return -1;
+	if (allocator(arena, q, 4096, 0)) return -1;
+	if (allocator_get_stats(arena, &s) < 0) return -1;
+	if (s.used != 0 || s.frees != n + 1) return -1;
+	if (allocator_reformat(arena, ALLOCATOR_TYPE_MULTI) < 0) return -1;
+	if (a->multi.count != 4 || multi_sub(a, 3)->type != ALLOCATOR_TYPE_LIST) return -1;
+	static unsigned char other[64];
+	if (multi_locate(a, other) || multi_locate(a, buf)) return -1;
+	if (allocator(arena, other, 64, 0) || allocator_get_stats(arena, &s) >= 0) return -1; /* foreign pointers kill the arena */
+	return 0;
+}
+
+static int attach_test(void) {
+	static unsigned char buf[1024 * 16], copy[(1024 * 16) + ALLOCATOR_ALIGNMENT];
+	allocator_stats_t s0;
+	const int types[] = { ALLOCATOR_TYPE_LIST, ALLOCATOR_TYPE_POOL, ALLOCATOR_TYPE_MULTI, };
+	unsigned char *to = (unsigned char*)alignup((uintptr_t)copy) + ((uintptr_t)buf & ALIGN_MASK);
+	void *arena = NULL, *moved = NULL;
+	if (allocator_attach(&moved, to, sizeof (buf)) >= 0) return -1;
+	for (size_t i = 0; i < (sizeof (types) / sizeof (types[0])); i++) {
+		const int r = types[i] == ALLOCATOR_TYPE_MULTI ?
+			allocator_format_multi(&arena, ALLOCATOR_TYPE_LIST, 2, buf, sizeof (buf)) :
+			allocator_format(&arena, types[i], buf, sizeof (buf));
+		if (r < 0) return -1;
+		unsigned char *p = allocator(arena, NULL, 0, 100);
+		if (!p) return -1;
+		memset(p, 5, 100);
+		const size_t off = p - buf;
+		memcpy(to, buf, sizeof (buf)); /* as if written out and mapped back in elsewhere */
+		if (allocator_attach(&moved, to, sizeof (buf) - 1) >= 0) return -1;
+		if (allocator_attach(&moved, to, sizeof (buf)) < 0) return -1;
+		if (!(p = allocator(moved, to + off, 100, 200)) || p[99] != 5) return -1;
+		allocator_stats_t s;
+		if (allocator_get_stats(moved, &s) < 0 || s.allocs != 1 || s.reallocs != 1) return -1;
+		if (allocator(moved, p, 200, 0)) return -1;
+		if (allocator_get_stats(moved, &s) < 0 || s.used != 0) return -1;
+	}
+	static unsigned char space[(1024 * 64) + (ALLOCATOR_SLAB_SIZE * 3)];
+	const size_t len = 1024 * 32;
+	unsigned char *from = (unsigned char*)(((uintptr_t)space + ALLOCATOR_SLAB_SIZE - 1u) & ~(uintptr_t)(ALLOCATOR_SLAB_SIZE - 1u));
+	unsigned char *same = from + len + ALLOCATOR_SLAB_SIZE, *p = NULL;
+	if (allocator_format(&arena, ALLOCATOR_TYPE_LIST | ALLOCATOR_FLAG_SIZED, from, len) < 0) return -1;
+	if (!(p = allocator(arena, NULL, 0, 24))) return -1;
+	memcpy(same, from, len); /* same offset within a slab, so slabs are found */
+	if (allocator_attach(&moved, same, len) < 0 || allocator(moved, same + (p - from), 24, 0)) return -1;
+	if (allocator_get_stats(moved, &s0) < 0 || s0.used) return -1;
+	memcpy(same + (ALLOCATOR_SLAB_SIZE / 2u), from, len); /* a different offset, they would not be */
+	if (allocator_attach(&moved, same + (ALLOCATOR_SLAB_SIZE / 2u), len) >= 0) return -1;
+	return 0;
+}
+
+static int virtual_test(void) {
+	void *arena = NULL;
+	const size_t len = 64ull * 1024ull * 1024ull, big = 8ull * 1024ull * 1024ull;
+	if (allocator_open_virtual(&arena, ALLOCATOR_TYPE_LIST | ALLOCATOR_FLAG_HUGE | ALLOCATOR_FLAG_RELEASE, len) < 0)
+		return ALLOCATOR_MMAP ? -1 : 0;
+	unsigned char *p = allocator(arena, NULL, 0, big), *q = allocator(arena, NULL, 0, 64);
+	if (!p || !q) return -1;
+	memset(p, 1, big);
+	if (allocator(arena, p, big, 0)) return -1;
+	if (p[big / 2] != 0) return -1; /* interior pages went back to the OS */
+	allocator(arena, q, 64, 0);
+	allocator_stats_t s;
+	if (allocator_get_stats(arena, &s) < 0 || s.used != 0 || s.total < (len - ALLOCATOR_HUGE_PAGE)) return -1;
+	return allocator_close_virtual(arena);
+}
+
+static int batch_test(void) {
+	static unsigned char buf[1024 * 16];
+	static void *p[256];
+	const int types[] = { ALLOCATOR_TYPE_LIST, ALLOCATOR_TYPE_POOL, ALLOCATOR_TYPE_NO_FREE, };
+	for (size_t i = 0; i < (sizeof (types) / sizeof (types[0])); i++) {
+		void *arena = NULL;
+		allocator_stats_t s;
+		if (allocator_format(&arena, types[i] | ALLOCATOR_FLAG_ZERO, buf, sizeof (buf)) < 0) return -1;
+		if (allocator_alloc_batch(arena, 24, 100, p) < 0) return -1;
+		for (size_t j = 0; j < 100; j++) {
+			unsigned char *q = p[j];
+			if (!q || ((uintptr_t)q & ALIGN_MASK) || q[23]) return -1;
+			if (j && (q == p[j - 1])) return -1;
+			memset(q, 0xFF, 24);
+		}
+		if (allocator_get_stats(arena, &s) < 0 || s.allocs != 100) return -1;
+		p[50] = NULL;
+		if (allocator_free_batch(arena, p, NULL, 100) < 0) return -1;
+		if (allocator_get_stats(arena, &s) < 0) return -1;
+		if (types[i] != ALLOCATOR_TYPE_NO_FREE && (s.frees != 99 || s.used == 0 || s.used > 32)) return -1;
+		const size_t used = s.used;
+		if (allocator_alloc_batch(arena, 256, 256, p) >= 0 || p[0]) return -1; /* too many, none are kept */
+		if (allocator_get_stats(arena, &s) < 0) return -1;
+		if (types[i] != ALLOCATOR_TYPE_NO_FREE && s.used != used) return -1;
+	}
+	void *arena = NULL;
+	if (allocator_format(&arena, ALLOCATOR_TYPE_LIST | ALLOCATOR_FLAG_SIZED, buf, sizeof (buf)) < 0) return -1;
+	if (allocator_alloc_batch(arena, 24, 10, p) < 0 || allocator_free_batch(arena, p, NULL, 10) >= 0) return -1; /* sizes are needed */
+	if (allocator_format(&arena, ALLOCATOR_TYPE_POOL, buf, sizeof (buf)) < 0) return -1;
+	if (allocator_alloc_batch(arena, 24, 10, p) < 0) return -1;
+	p[5] = buf; /* not a block, the blocks before it are freed */
+	if (allocator_free_batch(arena, p, NULL, 10) >= 0 || ((allocator_t*)arena)->counts.frees != 5) return -1;
+	return 0;
+}
+
+static int aligned_test(void) {
+	static unsigned char buf[1024 * 32];
+	const int types[] = { ALLOCATOR_TYPE_LIST, ALLOCATOR_TYPE_POOL, ALLOCATOR_TYPE_NO_FREE, ALLOCATOR_TYPE_MULTI, };
+	for (size_t i = 0; i < (sizeof (types) / sizeof (types[0])); i++) {
+		void *arena = NULL, *p[32] = { NULL, };
+		const int r = types[i] == ALLOCATOR_TYPE_MULTI ?
+			allocator_format_multi(&arena, ALLOCATOR_TYPE_LIST | ALLOCATOR_FLAG_ZERO, 2, buf, sizeof (buf)) :
+			allocator_format(&arena, types[i] | ALLOCATOR_FLAG_ZERO, buf, sizeof (buf));
+		if (r < 0) return -1;
+		allocator_stats_t s0, s1;
+		if (allocator_get_stats(arena, &s0) < 0) return -1;
+		if (allocator_aligned(arena, 16, 48)) return -1;
+		for (size_t j = 0; j < 32; j++) {
+			const size_t align = (size_t)32 << (j % 4);
+			unsigned char *q = p[j] = (j & 1) ? allocator(arena, NULL, 0, 40) : allocator_aligned(arena, 40, align);
+			if (!q) return -1;
+			if (!(j & 1) && ((uintptr_t)q & (align - 1u))) return -1;
+			if (q[39]) return -1;
+			memset(q, 0xFF, 40);
+		}
+		for (size_t j = 0; j < 32; j++)
+			if (allocator(arena, p[31 - j], 40, 0) && types[i] != ALLOCATOR_TYPE_NO_FREE) return -1;
+		if (allocator_get_stats(arena, &s1) < 0) return -1;
+		if (types[i] != ALLOCATOR_TYPE_NO_FREE && (s1.used != 0 || s1.free != s0.free || s1.allocs != 32)) return -1;
+	}
+	return 0;
+}
+
+static int sized_test(void) {
+	static unsigned char buf[1024 * 64];
+	static void *p[512];
+	allocator_stats_t s, h;
+	void *arena = NULL;
+	if (allocator_format(&arena, ALLOCATOR_TYPE_LIST, buf, sizeof (buf)) < 0) return -1;
+	for (size_t i = 0; i < 512; i++)
+		if (!(p[i] = allocator(arena, NULL, 0, 24))) return -1;
+	if (allocator_get_stats(arena, &h) < 0) return -1;
+	if (allocator_format(&arena, ALLOCATOR_TYPE_LIST | ALLOCATOR_FLAG_SIZED, buf, sizeof (buf)) < 0) return -1;
+	for (size_t i = 0; i < 512; i++) {
+		unsigned char *q = p[i] = allocator(arena, NULL, 0, 24);
+		if (!q || ((uintptr_t)q & ALIGN_MASK)) return -1;
+		memset(q, (int)i, 24);
+	}
+	if (allocator_get_stats(arena, &s) < 0) return -1;
+	if (s.used != (512 * 32) || s.free <= h.free) return -1; /* no headers, so less memory used */
+	unsigned char *q = p[7];
+	if (!(q = allocator(arena, q, 24, 200)) || q[23] != 7) return -1; /* out of the slab */
+	if (!(q = allocator(arena, q, 200, 20)) || q[19] != 7) return -1; /* and back in */
+	p[7] = q;
+	for (size_t i = 0; i < 512; i++)
+		if (allocator(arena, p[i], i == 7 ? 20 : 24, 0)) return -1;
+	if (allocator_get_stats(arena, &s) < 0 || s.used != 0 || arena_used(arena) != 0) return -1;
+	if (!(q = allocator(arena, NULL, 0, 24))) return -1;
+	if (allocator(arena, q, 48, 0) || (ALLOCATOR_VERIFY_SIZE && allocator(arena, NULL, 0, 24))) return -1; /* wrong size */
+	if (allocator_format(&arena, ALLOCATOR_TYPE_POOL | ALLOCATOR_FLAG_SIZED, buf, sizeof (buf)) < 0) return -1;
+	if (!(q = allocator(arena, NULL, 0, 24))) return -1;
+	if (allocator(arena, q, 24, 0) || allocator_get_stats(arena, &s) < 0 || s.frees != 1) return -1;
+	if (!(q = allocator(arena, NULL, 0, 24))) return -1;
+	if (allocator(arena, q, 48, 0) || (ALLOCATOR_VERIFY_SIZE && allocator(arena, NULL, 0, 24))) return -1;
+	return 0;
+}
+
+static int buddy_test(void) {
+	static unsigned char buf[1024 * 64];
+	static unsigned char *p[64];
+	allocator_stats_t s, h;
+	void *arena = NULL;
+	if (allocator_format(&arena, ALLOCATOR_TYPE_BUDDY, buf, sizeof (buf)) < 0) return -1;
+	if (allocator_get_stats(arena, &h) < 0 || h.used != 0 || h.largest < (sizeof (buf) / 4)) return -1;
+	for (size_t i = 0; i < 64; i++) {
+		const size_t sz = 1 + ((i * 97) % 700);
+		if (!(p[i] = allocator(arena, NULL, 0, sz))) return -1;
+		if (((uintptr_t)(p[i] - (unsigned char*)p[0]) % BUDDY_MIN) || ((uintptr_t)p[i] & ALIGN_MASK)) return -1;
+		memset(p[i], (int)i, sz);
+	}
+	for (size_t i = 0; i < 64; i++)
+		if (p[i][0] != i || p[i][(i * 97) % 700] != i) return -1;
+	if (allocator_get_stats(arena, &s) < 0 || s.used < (64 * 350) || s.free >= h.free) return -1;
+	unsigned char *q = p[3];
+	if (!(q = allocator(arena, q, 292, 40)) || q != p[3] || q[39] != 3) return -1; /* shrinks in place */
+	if (!(q = allocator(arena, q, 40, 3000)) || q[39] != 3) return -1;
+	p[3] = q;
+	for (size_t i = 1; i < 64; i += 2) /* buddies are free when their partners are */
+		if (allocator(arena, p[i], 0, 0)) return -1;
+	for (size_t i = 0; i < 64; i += 2)
+		if (allocator(arena, p[i], 0, 0)) return -1;
+	if (allocator_get_stats(arena, &s) < 0) return -1;
+	if (s.used != 0 || s.free != h.free || s.largest != h.largest || s.frees != 64) return -1;
+	if (!(q = allocator_aligned(arena, 100, 256)) || ((uintptr_t)q & 255)) return -1;
+	if (!(p[0] = allocator(arena, NULL, 0, 8)) || allocator(arena, NULL, 0, sizeof (buf))) return -1;
+	if (allocator(arena, p[0], 8, 0) || allocator(arena, q, 100, 0)) return -1;
+	if (allocator_get_stats(arena, &s) < 0 || s.free != h.free) return -1;
+	if (!(q = allocator(arena, NULL, 0, 64))) return -1;
+	if (allocator(arena, q + BUDDY_MIN, 0, 0) || allocator(arena, NULL, 0, 8)) return -1; /* invalid free */
+	return 0;
+}
+
+typedef struct {
+	unsigned char buf[1024];
+	size_t len;
+} record_buf_t;
+
+static int record_write(void *param, const allocator_event_t *e) {
+	record_buf_t *b = param;
+	const size_t n = allocator_event_encode(e, &b->buf[b->len], sizeof (b->buf) - b->len);
+	b->len += n;
+	return n ? 0 : -1;
+}
+
+static int record_test(void) {
+	static unsigned char buf[1024 * 16], rbuf[1024 * 16];
+	static record_buf_t rec;
+	allocator_replay_t map[8];
+	allocator_stats_t s, h;
+	allocator_event_t e = { .op = ALLOCATOR_EVENT_REALLOC, .thread = 3, .time = ~0ull, .old = 1, .ptr = 0x7FFF12345678ull, .oldsz = 0, .size = SIZE_MAX, }, d;
+	unsigned char ev[ALLOCATOR_EVENT_MAX];
+	const size_t n = allocator_event_encode(&e, ev, sizeof (ev));
+	if (n == 0 || allocator_event_decode(&d, ev, n) != n) return -1;
+	if (d.op != e.op || d.thread != e.thread || d.time != e.time || d.old != e.old || d.ptr != e.ptr || d.oldsz != e.oldsz || d.size != e.size) return -1;
+	if (allocator_event_decode(&d, ev, n - 1) != 0 || allocator_event_encode(&e, ev, n - 1) != 0) return -1;
+	void *arena = NULL, *replay = NULL;
+	if (allocator_format(&arena, ALLOCATOR_TYPE_LIST, buf, sizeof (buf)) < 0) return -1;
+	unsigned char *keep = allocator(arena, NULL, 0, 32); /* before recording, so never replayed */
+	if (!keep || allocator_set_record(arena, record_write, &rec) < 0) return -1;
+	unsigned char *p = allocator(arena, NULL, 0, 100), *q = NULL, *r = NULL;
+	if (!p || !(p = allocator(arena, p, 100, 300))) return -1;
+	if (!(q = allocator_aligned(arena, 64, 256)) || allocator(arena, NULL, 0, sizeof (buf))) return -1;
+	void *batch[4];
+	if (allocator_alloc_batch(arena, 48, 4, batch) < 0 || allocator_free_batch(arena, batch, NULL, 4) < 0) return -1;
+	if (!(r = allocator(arena, NULL, 0, 20)) || allocator(arena, p, 300, 0) || allocator(arena, keep, 32, 0)) return -1;
+	if (allocator_set_record(arena, NULL, NULL) < 0 || allocator_get_stats(arena, &h) < 0) return -1;
+	const int ops[] = { ALLOCATOR_EVENT_ALLOC, ALLOCATOR_EVENT_REALLOC, ALLOCATOR_EVENT_ALIGNED, ALLOCATOR_EVENT_ALLOC, };
+	size_t off = 0, events = 0;
+	for (size_t m = 0; off < rec.len; off += m, events++) {
+		if (!(m = allocator_event_decode(&d, &rec.buf[off], rec.len - off))) return -1;
+		if (events < 4 && d.op != ops[events]) return -1;
+		if (events == 1 && (d.oldsz != 100 || d.size != 300 || d.ptr != (uintptr_t)p)) return -1;
+		if (events == 2 && (d.oldsz != 256 || d.ptr != (uintptr_t)q)) return -1;
+		if (events == 3 && d.ptr != 0) return -1; /* failures are recorded too */
+	}
+	if (events != 15) return -1;
+	if (allocator_format(&replay, ALLOCATOR_TYPE_LIST, rbuf, sizeof (rbuf)) < 0) return -1;
+	memset(map, 0, sizeof (map));
+	if (allocator_replay(replay, rec.buf, rec.len, map, 8) != 0) return -1;
+	if (allocator_get_stats(replay, &s) < 0) return -1;
+	if (s.allocs != (h.allocs - 1) || s.frees != (h.frees - 1) || s.reallocs != h.reallocs) return -1;
+	if (s.used < (64 + 20)) return -1; /* 'q' and 'r', the padding around 'q' depends on where the buffer is */
+	if (allocator_replay(replay, rec.buf, rec.len - 1, map, 8) != -1) return -1; /* truncated */
+	return 0;
+}
+
+static int profile_test(void) {
+	static unsigned char buf[1024 * 64];
+	static size_t prof[512];
+	static void *p[32];
+	allocator_site_t sites[4];
+	void *arena = NULL;
+	if (allocator_format(&arena, ALLOCATOR_TYPE_LIST, buf, sizeof (buf)) < 0) return -1;
+	if (allocator_set_profile(arena, 64, prof, 16) != -1) return -1; /* too small */
+	if (allocator_set_profile(arena, 64, prof, sizeof (prof)) < 0) return -1;
+	const char *old = allocator_profile_tag("a");
+	for (size_t i = 0; i < 20; i++) /* much larger than the interval, so always sampled */
+		if (!(p[i] = allocator(arena, NULL, 0, 1000))) return -1;
+	(void)allocator_profile_tag("b");
+	for (size_t i = 20; i < 25; i++)
+		if (!(p[i] = allocator(arena, NULL, 0, 1000))) return -1;
+	(void)allocator_profile_tag(old);
+	for (size_t i = 25; i < 28; i++) /* charged to this function */
+		if (!(p[i] = allocator(arena, NULL, 0, 1000))) return -1;
+	if (allocator_get_profile(arena, sites, 4) != 3) return -1;
+	if (!sites[0].tagged || strcmp(sites[0].site, "a") || sites[0].bytes != 20000 || sites[0].objects != 20) return -1;
+	if (!sites[1].tagged || strcmp(sites[1].site, "b") || sites[1].bytes != 5000) return -1;
+	if (sites[2].tagged || sites[2].bytes != 3000) return -1;
+	if (allocator_get_profile(arena, sites, 1) != 1 || sites[0].bytes != 20000) return -1;
+	for (size_t i = 0; i < 20; i++)
+		if (allocator(arena, p[i], 1000, 0)) return -1;
+	if (!(p[20] = allocator(arena, p[20], 1000, 2000))) return -1; /* charged to the caller now */
+	const int n = allocator_get_profile(arena, sites, 4);
+	size_t untagged = 0, tagged = 0;
+	for (int i = 0; i < n; i++) /* each call is a site of its own, unless the compiler merged them */
+		*(sites[i].tagged ? &tagged : &untagged) += sites[i].bytes;
+	if (n < 2 || untagged != 5000 || tagged != 4000) return -1;
+	if (allocator_set_profile(arena, 0, NULL, 0) < 0 || allocator_get_profile(arena, sites, 4) != 0) return -1;
+	for (size_t i = 20; i < 28; i++)
+		if (allocator(arena, p[i], i == 20 ? 2000 : 1000, 0)) return -1;
+	return 0;
+}
+
+static int walk_count(void *param, void *ptr, size_t size, int state) {
+	size_t *n = param;
+	UNUSED(ptr);
+	UNUSED(size);
+	n[state]++;
+	return n[ALLOCATOR_WALK_USED] == 1000u; /* stops the walk */
+}
+
+typedef struct {
+	void *ptr[64];
+	int state[64];
+	size_t n;
+} walk_list_t;
+
+static int walk_list(void *param, void *ptr, size_t size, int state) {
+	walk_list_t *w = param;
+	UNUSED(size);
+	w->ptr[w->n] = ptr;
+	w->state[w->n] = state;
+	return ++w->n == 64u;
+}
+
+static int walk_test(void) {
+	static unsigned char buf[1024 * 64], shared[1024 * 64];
+	const int types[] = {
+		ALLOCATOR_TYPE_LIST, ALLOCATOR_TYPE_LIST | ALLOCATOR_FLAG_SIZED, ALLOCATOR_TYPE_POOL, ALLOCATOR_TYPE_BUDDY,
+		ALLOCATOR_TYPE_NO_FREE, ALLOCATOR_TYPE_MULTI, ALLOCATOR_TYPE_CACHE,
+	};
+	for (size_t t = 0; t < sizeof (types) / sizeof (types[0]); t++) {
+		const int type = types[t], cached = type == ALLOCATOR_TYPE_CACHE, nofree = type == ALLOCATOR_TYPE_NO_FREE;
+		void *arena = NULL, *sh = NULL, *p[8];
+		allocator_fragmentation_t f;
+		allocator_stats_t s;
+		size_t n[3] = { 0, };
+		if (type == ALLOCATOR_TYPE_MULTI) {
+			if (allocator_format_multi(&arena, ALLOCATOR_TYPE_LIST, 2, buf, sizeof (buf)) < 0) return -1;
+		} else if (cached) {
+			if (allocator_format(&sh, ALLOCATOR_TYPE_LIST, shared, sizeof (shared)) < 0) return -1;
+			if (allocator_format_cache(&arena, sh, buf, sizeof (buf)) < 0) return -1;
+		} else if (allocator_format(&arena, type, buf, sizeof (buf)) < 0) {
+			return -1;
+		}
+		for (size_t i = 0; i < 8; i++)
+			if (!(p[i] = allocator(arena, NULL, 0, 24 * (i + 1)))) return -1;
+		for (size_t i = 1; i < 8; i += 2)
+			if (allocator(arena, p[i], 24 * (i + 1), 0)) return -1;
+		for (size_t i = 0; i < 8; i++) { /* cached blocks are still in use by the shared arena, NO_FREE only frees the top */
+			if (allocator_is_ptr_valid(arena, p[i]) != 1) return -1;
+			if (allocator_is_ptr_allocated(arena, p[i]) != ((i & 1) == 0 || cached || (nofree && i != 7))) return -1;
+		}
+		if (allocator_is_ptr_valid(arena, buf + sizeof (buf)) != 0 || allocator_is_ptr_valid(arena, (unsigned char*)p[0] + 1) != nofree) return -1;
+		for (size_t i = 2; i < 8; i++) /* grow over the freed neighbour, in place where the arena can */
+			if (!(p[0] = allocator(arena, p[0], 24 * (i - 1), 24 * i))) return -1;
+		walk_list_t w = { .n = 0, };
+		if (allocator_walk(arena, walk_list, &w) < 0 || w.n < 2) return -1;
+		for (size_t i = 0; i < w.n; i++) { /* the lookups agree with the walk */
+			const int used = w.state[i] != ALLOCATOR_WALK_FREE;
+			if (allocator_is_ptr_valid(arena, w.ptr[i]) != 1 || allocator_is_ptr_allocated(arena, w.ptr[i]) != used) return -1;
+			if (allocator_is_ptr_valid(arena, (unsigned char*)w.ptr[i] + 1) != (w.state[i] == ALLOCATOR_WALK_SPAN)) return -1;
+		}
+		if (allocator_walk(arena, walk_count, n) < 0 || n[ALLOCATOR_WALK_USED] + n[ALLOCATOR_WALK_SPAN] < (nofree ? 1u : 4u)) return -1;
+		if (allocator_get_fragmentation(arena, &f) < 0 || f.free_blocks == 0 || f.largest == 0 || f.largest > f.free) return -1;
+		if (f.fragmentation > 1000u || (f.largest == f.free && f.fragmentation)) return -1;
+		size_t bins = 0;
+		for (size_t i = 0; i < sizeof (f.histogram) / sizeof (f.histogram[0]); i++)
+			bins += f.histogram[i];
+		if (bins != f.free_blocks || !f.histogram[bit_fls(f.largest)]) return -1;
+		if (allocator_get_stats(cached ? sh : arena, &s) < 0) return -1;
+		if (type == ALLOCATOR_TYPE_LIST && (f.free + (f.free_blocks * LIST_HDR) != s.free || f.largest < s.largest)) return -1;
+		if ((type == ALLOCATOR_TYPE_POOL || type == ALLOCATOR_TYPE_BUDDY) && (f.free != s.free || f.used != s.used)) return -1;
+	}
+	return 0;
+}
+
+ALLOCATOR_DECLARE(typed_list, LIST, 0)
+ALLOCATOR_DECLARE(typed_bump, NO_FREE, 0)
+ALLOCATOR_DECLARE(typed_wide, LIST, 256)
+ALLOCATOR_DECLARE(typed_wide_pool, POOL, 256)
+
+static int typed_count(void *param, const allocator_event_t *e) {
+	UNUSED(e);
+	(*(size_t*)param)++;
+	return 0;
+}
+
+static int typed_test(void) {
+	static unsigned char buf[1024 * 64];
+	void *arena = NULL, *p[4];
+	allocator_fn fn = typed_list;
+	allocator_stats_t s;
+	size_t events = 0;
+	if (allocator_format(&arena, ALLOCATOR_TYPE_LIST, buf, sizeof (buf)) < 0) return -1;
+	if (!(p[0] = fn(arena, NULL, 0, 100))) return -1;
+	memset(p[0], 0x5A, 100);
+	if (!(p[0] = fn(arena, p[0], 100, 3000)) || ((unsigned char*)p[0])[99] != 0x5A) return -1;
+	if (!(p[1] = typed_wide(arena, NULL, 0, 40)) || ((uintptr_t)p[1] & 255u)) return -1;
+	memset(p[1], 0xA5, 40);
+	if (!(p[1] = typed_wide(arena, p[1], 40, 500)) || ((uintptr_t)p[1] & 255u) || ((unsigned char*)p[1])[39] != 0xA5) return -1;
+	if (!(p[1] = typed_wide(arena, p[1], 500, 200)) || ((uintptr_t)p[1] & 255u) || ((unsigned char*)p[1])[39] != 0xA5) return -1;
+	if (typed_wide_pool(arena, NULL, 0, 40)) return -1; /* aligned allocations check the type */
+	if (!(p[2] = typed_bump(arena, NULL, 0, 64))) return -1; /* wrong type, works as 'allocator' does */
+	if (allocator_set_record(arena, typed_count, &events) < 0) return -1;
+	if (!(p[3] = fn(arena, NULL, 0, 32)) || events != 1) return -1;
+	if (allocator_set_record(arena, NULL, NULL) < 0) return -1;
+	if (fn(arena, p[0], 3000, 0) || typed_wide(arena, p[1], 200, 0) || typed_bump(arena, p[2], 64, 0) || fn(arena, p[3], 32, 0)) return -1;
+	if (allocator_get_stats(arena, &s) < 0 || s.used || s.allocs != s.frees || s.reallocs != 1) return -1;
+
+	if (allocator_format(&arena, ALLOCATOR_TYPE_NO_FREE, buf, sizeof (buf)) < 0) return -1;
+	for (size_t i = 0; i < 4; i++)
+		if (!(p[i] = typed_bump(arena, NULL, 0, 24)) || ((uintptr_t)p[i] & ALIGN_MASK) || (i && p[i] <= p[i - 1])) return -1;
+	if (typed_bump(arena, p[3], 24, 0)) return -1;
+	if (allocator_get_stats(arena, &s) < 0 || s.allocs != 4 || s.frees != 1 || s.used != (size_t)((unsigned char*)p[3] - arena_mem(arena))) return -1;
+
+	if (allocator_format(&arena, ALLOCATOR_TYPE_LIST | ALLOCATOR_FLAG_SIZED, buf, sizeof (buf)) < 0) return -1;
+	if (!(p[0] = typed_wide(arena, NULL, 0, 200)) || ((uintptr_t)p[0] & 255u)) return -1;
+	memset(p[0], 0x3C, 200);
+	if (!(p[0] = typed_wide(arena, p[0], 200, 100)) || ((uintptr_t)p[0] & 255u) || ((unsigned char*)p[0])[99] != 0x3C) return -1;
+	if (typed_wide(arena, p[0], 100, 32)) return -1; /* would go in a slab, so cannot be aligned, 'p[0]' is kept */
+	if (typed_wide(arena, p[0], 100, 0) || !(p[1] = allocator(arena, NULL, 0, 32))) return -1;
+	if (allocator(arena, p[1], 32, 0)) return -1;
+	if (allocator_get_stats(arena, &s) < 0 || s.used || s.allocs != s.frees) return -1;
+	return 0;
+}
+
+#if ALLOCATOR_PTHREADS
+typedef struct {
+	void *arena;
+	unsigned seed;
+	int failed;
+} stress_t;
+
+/* Each thread allocates, fills, checks and frees objects at random, so any
+ * block handed out twice, or overlapping another, shows up as a bad fill. */
+static void *stress_thread(void *param) {
+	stress_t *t = param;
+	enum { OBJECTS = 64, };
+	unsigned char *p[OBJECTS] = { NULL, };
+	size_t n[OBJECTS] = { 0, };
+	unsigned x = t->seed;
+	for (size_t i = 0; i < 20000u; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		const size_t j = x % OBJECTS;
+		const unsigned char fill = (unsigned char)(j ^ t->seed);
+		if (p[j]) {
+			for (size_t k = 0; k < n[j]; k++)
+				t->failed |= p[j][k] != fill;
+			(void)allocator(t->arena, p[j], n[j], 0);
+			p[j] = NULL;
+			continue;
+		}
+		n[j] = 1u + ((x >> 8) % 300u);
+		if ((p[j] = allocator(t->arena, NULL, 0, n[j])))
+			memset(p[j], fill, n[j]);
+	}
+	for (size_t j = 0; j < OBJECTS; j++)
+		if (p[j])
+			(void)allocator(t->arena, p[j], n[j], 0);
+	return NULL;
+}
+#endif
+
+static int thread_test(void) {
+	static unsigned char buf[1024 * 1024];
+	const int types[] = {
+		ALLOCATOR_TYPE_LIST, ALLOCATOR_TYPE_LIST | ALLOCATOR_FLAG_SIZED, ALLOCATOR_TYPE_NO_FREE,
+		ALLOCATOR_TYPE_POOL, ALLOCATOR_TYPE_BUDDY, ALLOCATOR_TYPE_MULTI,
+	};
+	for (size_t i = 0; i < (sizeof (types) / sizeof (types[0])); i++) {
+		void *arena = NULL;
+		const int fmt = types[i] == ALLOCATOR_TYPE_MULTI ?
+			allocator_format_multi(&arena, ALLOCATOR_TYPE_LIST, 4, buf, sizeof (buf)) :
+			allocator_format(&arena, types[i] | ALLOCATOR_FLAG_THREAD_SAFE, buf, sizeof (buf));
+		if (fmt < 0)
+			return ALLOCATOR_ATOMICS ? -1 : 0;
+		void *p = allocator(arena, NULL, 0, 100);
+		if (!p) return -1;
+		if (!(p = allocator(arena, p, 100, 200))) return -1;
+		if (allocator(arena, p, 200, 0)) return -1;
+		allocator_stats_t s;
+		if (allocator_get_stats(arena, &s) < 0) return -1;
+		if (s.allocs != 1 || s.reallocs != 1 || s.frees != 1) return -1;
+#if ALLOCATOR_PTHREADS
+		enum { THREADS = 4, };
+		pthread_t th[THREADS];
+		stress_t st[THREADS];
+		size_t n[3] = { 0, };
+		for (size_t j = 0; j < THREADS; j++) {
+			st[j] = (stress_t) { .arena = arena, .seed = (unsigned)(j + 1u) * 2654435761u, .failed = 0, };
+			if (pthread_create(&th[j], NULL, stress_thread, &st[j])) return -1;
+		}
+		for (size_t j = 0; j < THREADS; j++)
+			if (pthread_join(th[j], NULL) || st[j].failed) return -1;
+		if (allocator_get_stats(arena, &s) < 0 || allocator_walk(arena, walk_count, n) < 0) return -1;
+		if (types[i] == ALLOCATOR_TYPE_NO_FREE)
+			continue; /* only frees of the top allocation are counted */
+		if (s.used || s.allocs != s.frees || n[ALLOCATOR_WALK_USED] || n[ALLOCATOR_WALK_SPAN]) return -1;
+#endif
+	}
+	return 0;
+}
+
 int allocator_test(void) {
 	if (alignup(0) != 0) return -1;
 	if (alignup(1) != ALLOCATOR_ALIGNMENT) return -1;
 	if (alignup(ALLOCATOR_ALIGNMENT - 1ull) != ALLOCATOR_ALIGNMENT) return -1;
 	if (alignup(ALLOCATOR_ALIGNMENT) != ALLOCATOR_ALIGNMENT) return -1;
 	if (alignup(ALLOCATOR_ALIGNMENT + 1ull) != (2ull * ALLOCATOR_ALIGNMENT)) return -1;
+	if (list_test() < 0) return -1;
+	if (nofree_test() < 0) return -1;
+	if (lazy_test() < 0) return -1;
+	if (stats_test() < 0) return -1;
+	if (pool_test() < 0) return -1;
+	if (thread_test() < 0) return -1;
+	if (cache_test() < 0) return -1;
+	if (owner_test() < 0) return -1;
+	if (multi_test() < 0) return -1;
+	if (attach_test() < 0) return -1;
+	if (virtual_test() < 0) return -1;
+	if (batch_test() < 0) return -1;
+	if (aligned_test() < 0) return -1;
+	if (sized_test() < 0) return -1;
+	if (buddy_test() < 0) return -1;
+	if (record_test() < 0) return -1;
+	if (profile_test() < 0) return -1;
+	if (walk_test() < 0) return -1;
+	if (typed_test() < 0) return -1;
 	return 0;
 }
 
@@ -7,28 +7,157 @@ extern "C" {
 #endif
 
 #include <stddef.h>
+#include <string.h>
 #include <stdarg.h>
+#include <limits.h>
 
 #ifndef ALLOCATOR_FN
 #define ALLOCATOR_FN
 typedef void *(*allocator_fn)(void *arena, void *ptr, size_t oldsz, size_t newsz);
 #endif
 
-enum { ALLOCATOR_TYPE_DEFAULT, ALLOCATOR_TYPE_LIST, ALLOCATOR_TYPE_NO_FREE, ALLOCATOR_TYPE_FAIL, };
+enum { ALLOCATOR_TYPE_DEFAULT, ALLOCATOR_TYPE_LIST, ALLOCATOR_TYPE_NO_FREE, ALLOCATOR_TYPE_FAIL, ALLOCATOR_TYPE_POOL, ALLOCATOR_TYPE_CACHE, ALLOCATOR_TYPE_MULTI, ALLOCATOR_TYPE_BUDDY, };
+
+enum { /* flags that can be or'ed into the type passed to 'allocator_format' */
+	ALLOCATOR_TYPE_MASK = 0xFF,
+	ALLOCATOR_FLAG_ZERO = 1 << 8, /* zero memory on allocation/growth, like 'calloc' */
+	ALLOCATOR_FLAG_THREAD_SAFE = 1 << 9, /* allow concurrent calls to 'allocator' on the arena, NO_FREE and POOL arenas
+	                                      * scale, calls on a LIST or BUDDY arena are serialised by a single lock */
+	ALLOCATOR_FLAG_HUGE = 1 << 10, /* back an 'allocator_open_virtual' arena with huge pages */
+	ALLOCATOR_FLAG_RELEASE = 1 << 11, /* return large free spans to the OS, buffer must be mapped memory */
+	ALLOCATOR_FLAG_SIZED = 1 << 12, /* callers always pass the exact 'oldsz', small objects have no header */
+};
+
+typedef struct {
+	size_t total;    /* bytes managed by the arena, excluding its header */
+	size_t used;     /* bytes available to callers in outstanding allocations */
+	size_t free;     /* bytes in free blocks */
+	size_t overhead; /* bytes lost to metadata, headers and padding */
+	size_t peak;     /* high water mark of 'used' */
+	size_t largest;  /* largest allocation guaranteed to succeed */
+	size_t allocs, frees, reallocs; /* number of successful calls of each kind */
+} allocator_stats_t;
 
 typedef int (*allocator_trace_fn)(void *param, const char *fmt, va_list ap);
 
+enum { /* states of the blocks passed to an 'allocator_walk_fn' */
+	ALLOCATOR_WALK_FREE,
+	ALLOCATOR_WALK_USED,
+	ALLOCATOR_WALK_SPAN, /* allocated, but where one object ends and another starts is not kept */
+};
+
+typedef int (*allocator_walk_fn)(void *param, void *ptr, size_t size, int state);
+
+typedef struct {
+	size_t free_blocks, used_blocks;
+	size_t free, used;     /* bytes available to callers in free and used blocks */
+	size_t largest;        /* largest free block */
+	size_t fragmentation;  /* external fragmentation in parts per thousand, '1000 * (1 - largest / free)' */
+	size_t histogram[sizeof (size_t) * CHAR_BIT]; /* free blocks by size, bin 'i' holds those of '2^i' up to '2^(i+1)' bytes */
+} allocator_fragmentation_t;
+
+enum { ALLOCATOR_EVENT_ALLOC = 1, ALLOCATOR_EVENT_REALLOC, ALLOCATOR_EVENT_FREE, ALLOCATOR_EVENT_ALIGNED, };
+
+enum { ALLOCATOR_EVENT_MAX = 64, }; /* largest encoded event in bytes */
+
+typedef struct {
+	int op;                      /* one of ALLOCATOR_EVENT_* */
+	unsigned long thread;        /* small number per thread, handed out in order of first use */
+	unsigned long long time;     /* monotonic nanoseconds, zero if there is no clock */
+	unsigned long long old, ptr; /* address passed in and address returned, zero for none (or failure) */
+	size_t oldsz, size;          /* sizes passed in, 'oldsz' is the alignment for ALLOCATOR_EVENT_ALIGNED */
+} allocator_event_t;
+
+typedef int (*allocator_record_fn)(void *param, const allocator_event_t *event);
+
+typedef struct {
+	const void *site; /* tag given to 'allocator_profile_tag', or address 'allocator' was called from */
+	int tagged;       /* non-zero if 'site' is a tag */
+	size_t bytes;     /* estimated live bytes allocated from this site */
+	size_t objects;   /* estimated live objects allocated from this site */
+} allocator_site_t;
+
+typedef struct {
+	unsigned long long recorded; /* address in the trace, zero if the entry is empty */
+	void *replayed;              /* the allocation made for it when replaying */
+} allocator_replay_t;
+
 int allocator_format(void **arena, int type, unsigned char *buf, size_t len);
 int allocator_reformat(void *arena, int type);
+int allocator_attach(void **arena, unsigned char *buf, size_t len);
+int allocator_open_file(void **arena, const char *file, int type, size_t len);
+int allocator_sync(void *arena);
+int allocator_close_file(void *arena);
+int allocator_open_virtual(void **arena, int type, size_t len);
+int allocator_close_virtual(void *arena);
+int allocator_format_cache(void **arena, void *shared, unsigned char *buf, size_t len);
+int allocator_format_multi(void **arena, int type, size_t count, unsigned char *buf, size_t len);
+int allocator_flush(void *arena);
 int allocator_is_ptr_valid(void *arena, void *ptr);
 int allocator_is_ptr_allocated(void *arena, void *ptr);
+int allocator_walk(void *arena, allocator_walk_fn walk, void *param);
+int allocator_get_fragmentation(void *arena, allocator_fragmentation_t *frag);
+int allocator_alloc_batch(void *arena, size_t size, size_t count, void **ptrs);
+int allocator_free_batch(void *arena, void **ptrs, const size_t *sizes, size_t count); /* 'sizes' is needed by cache and sized arenas */
+int allocator_mark(void *arena, size_t *mark);
+int allocator_rewind(void *arena, size_t mark);
+int allocator_set_owner(void *arena, int owned);
 int allocator_set_trace(void *arena, allocator_trace_fn trace, void *param);
+int allocator_set_record(void *arena, allocator_record_fn record, void *param);
+size_t allocator_event_encode(const allocator_event_t *event, unsigned char *buf, size_t len);
+size_t allocator_event_decode(allocator_event_t *event, const unsigned char *buf, size_t len);
+int allocator_replay(void *arena, const unsigned char *trace, size_t len, allocator_replay_t *map, size_t entries);
+int allocator_set_profile(void *arena, size_t interval, void *buf, size_t len);
+int allocator_get_profile(void *arena, allocator_site_t *sites, size_t count);
+const char *allocator_profile_tag(const char *tag);
+int allocator_get_stats(void *arena, allocator_stats_t *stats);
 int allocator_get_max_allocatable(void *arena, size_t *size);
 int allocator_get_overhead(void *arena, size_t *size);
 int allocator_get_free(void *arena, size_t *size);
 int allocator_get_total(void *arena, size_t *size);
 int allocator_test(void);
 void *allocator(void *arena, void *ptr, size_t oldsz, size_t newsz);
+void *allocator_aligned(void *arena, size_t size, size_t align);
+void *allocator_aligned_typed(void *arena, int type, size_t size, size_t align);
+void *allocator_list(void *arena, void *ptr, size_t oldsz, size_t newsz);
+void *allocator_no_free(void *arena, void *ptr, size_t oldsz, size_t newsz);
+void *allocator_pool(void *arena, void *ptr, size_t oldsz, size_t newsz);
+void *allocator_buddy(void *arena, void *ptr, size_t oldsz, size_t newsz);
+void *allocator_cache(void *arena, void *ptr, size_t oldsz, size_t newsz);
+void *allocator_multi(void *arena, void *ptr, size_t oldsz, size_t newsz);
+
+#define ALLOCATOR_FN_LIST    allocator_list
+#define ALLOCATOR_FN_NO_FREE allocator_no_free
+#define ALLOCATOR_FN_POOL    allocator_pool
+#define ALLOCATOR_FN_BUDDY   allocator_buddy
+#define ALLOCATOR_FN_CACHE   allocator_cache
+#define ALLOCATOR_FN_MULTI   allocator_multi
+
+/* Declare an inline 'allocator_fn' for arenas of a type known at compile
+ * time, 'TYPE' is one of LIST, NO_FREE, POOL, BUDDY, CACHE or MULTI. If
+ * 'ALIGN' is non-zero, allocations and reallocations are aligned to it, it
+ * must be a power of two. For example:
+ *
+ * 	ALLOCATOR_DECLARE(scratch_alloc, NO_FREE, 0)
+ * 	ALLOCATOR_DECLARE(simd_alloc, LIST, 64)
+ *
+ * The call still goes into the library, all it saves is the switch on the
+ * arena type (arenas with an owner, or being recorded or profiled, take the
+ * usual path). With an 'ALIGN' the arena must be of type 'TYPE' or NULL is
+ * returned, and reallocating always moves the object, so it is freed with
+ * the size it was last given. A sized arena cannot align objects small
+ * enough to go in a slab, those return NULL. */
+#define ALLOCATOR_DECLARE(NAME, TYPE, ALIGN)\
+	static inline void *NAME(void *arena, void *ptr, size_t oldsz, size_t newsz) {\
+		if ((ALIGN) == 0 || newsz == 0)\
+			return ALLOCATOR_FN_##TYPE(arena, ptr, oldsz, newsz);\
+		void *r = allocator_aligned_typed(arena, ALLOCATOR_TYPE_##TYPE, newsz, (ALIGN));\
+		if (r && ptr) {\
+			memcpy(r, ptr, oldsz < newsz ? oldsz : newsz);\
+			(void)ALLOCATOR_FN_##TYPE(arena, ptr, oldsz, 0);\
+		}\
+		return r;\
+	}
 
 
 #ifdef __cplusplus
@@ -0,0 +1,359 @@
+/* Richard James Howe, Email: howe.r.j.89@gmail.com, Public Domain, https:github.com/howerj/allocator */
+
+/* Benchmark every arena type, and for comparison the system allocator, the
+ * block pool in 'docs/block.c' and the K&R allocator in 'docs/kr1.c', over
+ * the same reproducible allocation traces. Each workload is run twice, once
+ * untimed per operation for throughput and once timing every call for the
+ * latency percentiles, which include the cost of reading the clock. Peak is
+ * the high water mark reported by the backend and fragmentation is
+ * '1 - largest / free', over the free blocks 'allocator_get_fragmentation'
+ * finds, at the end of the workload before everything is freed, where the
+ * backend can report them. Backends marked with a '*' call the allocation
+ * function for their arena type rather than 'allocator'. Usage:
+ *
+ * 	allocator-bench [operations] [seed]
+ */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#include "allocator.h"
+#include "block.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+union header;
+static union header *morecore(size_t nu);
+static void kr_free(void *ap);
+#include "kr1.c"
+
+#define BENCH_ARENA   (64ul * 1024ul * 1024ul)
+#define BENCH_SLOTS   (4096u)
+#define BENCH_REALLOC (256u)    /* buffers grown by the realloc workload */
+#define BENCH_GROW    (65536u)  /* largest size a buffer is grown to before it is freed */
+
+typedef struct {
+	const char *name;
+	int type; /* of arena, if it is one */
+	int (*open)(void **state, int type);
+	void *(*alloc)(void *state, size_t n);
+	void (*release)(void *state, void *p, size_t n);
+	void *(*resize)(void *state, void *p, size_t oldsz, size_t newsz);
+	void (*stats)(void *state, size_t *peak, double *frag);
+	void (*close)(void *state);
+} backend_t;
+
+typedef struct {
+	void *p;
+	size_t n;
+} slot_t;
+
+typedef struct {
+	const char *name;
+	size_t (*op)(const backend_t *b, void *state, slot_t *s, uint64_t *rng); /* returns 0 on failure */
+} workload_t;
+
+static unsigned char *arena_buf, *cache_buf, *kr_heap;
+static size_t kr_top;
+
+static uint64_t now(void) {
+	struct timespec ts;
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t rnd(uint64_t *s) { /* xorshift64, reproducible across platforms */
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static size_t rnd_size(uint64_t *s, size_t lo, size_t hi) { /* log-uniform in [lo, hi), small objects dominate */
+	size_t classes = 1;
+	while ((lo << (classes + 1u)) <= hi)
+		classes++;
+	const size_t n = lo << (rnd(s) % classes);
+	return n + (size_t)(rnd(s) % n);
+}
+
+static int arena_open(void **state, int type) {
+	if ((type & ALLOCATOR_TYPE_MASK) == ALLOCATOR_TYPE_MULTI)
+		return allocator_format_multi(state, ALLOCATOR_TYPE_LIST, 4, arena_buf, BENCH_ARENA);
+	if ((type & ALLOCATOR_TYPE_MASK) == ALLOCATOR_TYPE_CACHE) {
+		void *shared = NULL;
+		if (allocator_format(&shared, ALLOCATOR_TYPE_LIST, arena_buf, BENCH_ARENA) < 0)
+			return -1;
+		return allocator_format_cache(state, shared, cache_buf, BENCH_ARENA / 16u);
+	}
+	return allocator_format(state, type, arena_buf, BENCH_ARENA);
+}
+
+static void *arena_alloc(void *state, size_t n) { return allocator(state, NULL, 0, n); }
+static void arena_release(void *state, void *p, size_t n) { (void)allocator(state, p, n, 0); }
+static void *arena_resize(void *state, void *p, size_t oldsz, size_t newsz) { return allocator(state, p, oldsz, newsz); }
+
+/* The same calls made through an allocation function for one arena type */
+#define TYPED(FN)\
+	static void *FN##_alloc(void *state, size_t n) { return FN(state, NULL, 0, n); }\
+	static void FN##_release(void *state, void *p, size_t n) { (void)FN(state, p, n, 0); }\
+	static void *FN##_resize(void *state, void *p, size_t oldsz, size_t newsz) { return FN(state, p, oldsz, newsz); }
+
+TYPED(allocator_list)
+TYPED(allocator_no_free)
+
+/* Fragmentation comes from walking the arena, so a cache arena reports that
+ * of its shared arena. Pool arenas have no contiguous free runs, each block
+ * is a fixed size, so theirs would always be close to one and is left out. */
+static void arena_peak(void *state, size_t *peak, double *frag) {
+	allocator_stats_t s;
+	(void)frag;
+	if (allocator_get_stats(state, &s) >= 0)
+		*peak = s.peak;
+}
+
+static void arena_stats(void *state, size_t *peak, double *frag) {
+	allocator_fragmentation_t f;
+	arena_peak(state, peak, frag);
+	if (allocator_get_fragmentation(state, &f) >= 0)
+		*frag = (double)f.fragmentation / 1000.0;
+}
+
+static void arena_close(void *state) { (void)allocator_flush(state); }
+
+static int libc_open(void **state, int type) { (void)type; *state = NULL; return 0; }
+static void *libc_alloc(void *state, size_t n) { (void)state; return malloc(n); }
+static void libc_release(void *state, void *p, size_t n) { (void)state; (void)n; free(p); }
+static void *libc_resize(void *state, void *p, size_t oldsz, size_t newsz) { (void)state; (void)oldsz; return realloc(p, newsz); }
+
+static int block_open(void **state, int type) {
+	(void)type;
+	pool_specification_t specs[13];
+	for (size_t i = 0; i < 13; i++) /* an equal share of the arena for each size from 16 to 64KiB */
+		specs[i] = (pool_specification_t) { .blocksz = (size_t)16u << i, .count = (BENCH_ARENA / 16u) / ((size_t)16u << i), };
+	return (*state = pool_new(13, specs)) ? 0 : -1;
+}
+
+static void *block_alloc(void *state, size_t n) { return pool_malloc(state, n); }
+static void block_release(void *state, void *p, size_t n) { (void)n; (void)pool_free(state, p); }
+static void *block_resize(void *state, void *p, size_t oldsz, size_t newsz) { (void)oldsz; return pool_realloc(state, p, newsz); }
+static void block_stats(void *state, size_t *peak, double *frag) { (void)frag; *peak = ((pool_t*)state)->max; }
+static void block_close(void *state) { pool_delete(state); }
+
+/* 'docs/kr1.c' only has 'malloc', the rest of the K&R allocator is here, with
+ * 'morecore' carving from a fixed heap rather than calling 'sbrk'. */
+static union header *morecore(size_t nu) {
+	if (nu < 1024u)
+		nu = 1024u;
+	const size_t bytes = nu * sizeof (Header);
+	if ((BENCH_ARENA * 4u) - kr_top < bytes)
+		return NULL;
+	Header *up = (Header*)&kr_heap[kr_top];
+	kr_top += bytes;
+	up->s.size = nu;
+	kr_free(up + 1);
+	return freeptr;
+}
+
+static void kr_free(void *ap) {
+	Header *bp = (Header*)ap - 1, *p = freeptr;
+	for (; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
+		if (p >= p->s.ptr && (bp > p || bp < p->s.ptr))
+			break; /* freed block at start or end of arena */
+	if (bp + bp->s.size == p->s.ptr) { /* join to upper neighbour */
+		bp->s.size += p->s.ptr->s.size;
+		bp->s.ptr = p->s.ptr->s.ptr;
+	} else {
+		bp->s.ptr = p->s.ptr;
+	}
+	if (p + p->s.size == bp) { /* join to lower neighbour */
+		p->s.size += bp->s.size;
+		p->s.ptr = bp->s.ptr;
+	} else {
+		p->s.ptr = bp;
+	}
+	freeptr = p;
+}
+
+static int kr_open(void **state, int type) { (void)type; *state = NULL; freeptr = NULL; kr_top = 0; return 0; }
+static void *kr_alloc(void *state, size_t n) { (void)state; return kr_malloc(n); }
+static void kr_release(void *state, void *p, size_t n) { (void)state; (void)n; if (p) kr_free(p); }
+
+static void *kr_resize(void *state, void *p, size_t oldsz, size_t newsz) {
+	(void)state;
+	void *r = kr_malloc(newsz);
+	if (!r)
+		return NULL;
+	memcpy(r, p, oldsz < newsz ? oldsz : newsz);
+	kr_free(p);
+	return r;
+}
+
+static void kr_stats(void *state, size_t *peak, double *frag) { (void)state; (void)frag; *peak = kr_top; }
+
+static void nothing(void *state) { (void)state; }
+
+#define ARENA(NAME, TYPE) { NAME, TYPE, arena_open, arena_alloc, arena_release, arena_resize, arena_stats, arena_close, }
+#define ARENA_TYPED(NAME, TYPE, FN) { NAME, TYPE, arena_open, FN##_alloc, FN##_release, FN##_resize, arena_stats, arena_close, }
+
+static const backend_t backends[] = {
+	ARENA("list",    ALLOCATOR_TYPE_LIST),
+	ARENA_TYPED("list*", ALLOCATOR_TYPE_LIST, allocator_list),
+	ARENA("sized",   ALLOCATOR_TYPE_LIST | ALLOCATOR_FLAG_SIZED),
+	{ "pool", ALLOCATOR_TYPE_POOL, arena_open, arena_alloc, arena_release, arena_resize, arena_peak, arena_close, },
+	ARENA("buddy",   ALLOCATOR_TYPE_BUDDY),
+	ARENA("no-free", ALLOCATOR_TYPE_NO_FREE),
+	ARENA_TYPED("no-free*", ALLOCATOR_TYPE_NO_FREE, allocator_no_free),
+	ARENA("cache",   ALLOCATOR_TYPE_CACHE),
+	ARENA("multi",   ALLOCATOR_TYPE_MULTI),
+	ARENA("locked",  ALLOCATOR_TYPE_LIST | ALLOCATOR_FLAG_THREAD_SAFE),
+	{ "malloc", 0, libc_open, libc_alloc, libc_release, libc_resize, NULL, nothing, },
+	{ "block",  0, block_open, block_alloc, block_release, block_resize, block_stats, block_close, },
+	{ "k&r",    0, kr_open, kr_alloc, kr_release, kr_resize, kr_stats, nothing, },
+};
+
+static size_t toggle(const backend_t *b, void *state, slot_t *s, size_t n) {
+	if (s->p) {
+		b->release(state, s->p, s->n);
+		s->p = NULL;
+		return 1;
+	}
+	if (!(s->p = b->alloc(state, n)))
+		return 0;
+	s->n = n;
+	*(unsigned char*)s->p = 1; /* touch it, as a real caller would */
+	return 1;
+}
+
+static size_t churn(const backend_t *b, void *state, slot_t *s, uint64_t *rng) {
+	return toggle(b, state, &s[rnd(rng) % BENCH_SLOTS], 64);
+}
+
+static size_t random_sizes(const backend_t *b, void *state, slot_t *s, uint64_t *rng) {
+	const size_t i = rnd(rng) % BENCH_SLOTS;
+	return toggle(b, state, &s[i], rnd_size(rng, 8, 4096));
+}
+
+/* Objects are freed in the order they were allocated, as messages passed
+ * from a producer to a consumer are; slot 'BENCH_SLOTS' holds the queue. */
+static size_t fifo(const backend_t *b, void *state, slot_t *s, uint64_t *rng) {
+	slot_t *q = &s[BENCH_SLOTS];
+	const size_t head = q->n & 0xFFFFu, tail = q->n >> 16, count = (head - tail) & (BENCH_SLOTS - 1u);
+	if (count < (BENCH_SLOTS - 1u) && (count == 0 || (rnd(rng) & 1u))) {
+		if (!toggle(b, state, &s[head], rnd_size(rng, 16, 1024)))
+			return 0;
+		q->n = (tail << 16) | ((head + 1u) & (BENCH_SLOTS - 1u));
+		return 1;
+	}
+	if (s[tail].p)
+		(void)toggle(b, state, &s[tail], 0);
+	q->n = (((tail + 1u) & (BENCH_SLOTS - 1u)) << 16) | head;
+	return 1;
+}
+
+static size_t growth(const backend_t *b, void *state, slot_t *s, uint64_t *rng) {
+	slot_t *g = &s[rnd(rng) % BENCH_REALLOC];
+	const size_t n = g->p ? g->n + (g->n / 2u) + 16u : 16u;
+	if (!g->p || n > BENCH_GROW)
+		return toggle(b, state, g, 16);
+	void *r = b->resize(state, g->p, g->n, n);
+	if (!r)
+		return 0;
+	g->p = r;
+	g->n = n;
+	return 1;
+}
+
+static const workload_t workloads[] = {
+	{ "churn",   churn, },
+	{ "random",  random_sizes, },
+	{ "fifo",    fifo, },
+	{ "realloc", growth, },
+};
+
+static int compare(const void *a, const void *b) {
+	const uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static void drain(const backend_t *b, void *state, slot_t *s) {
+	for (size_t i = 0; i < BENCH_SLOTS; i++)
+		if (s[i].p)
+			(void)toggle(b, state, &s[i], 0);
+	memset(s, 0, sizeof (*s) * (BENCH_SLOTS + 1u));
+}
+
+static int run(FILE *out, const workload_t *w, const backend_t *b, size_t ops, uint64_t seed, slot_t *s, uint32_t *lat) {
+	void *state = NULL;
+	size_t fails = 0, peak = 0;
+	double frag = -1.0;
+	uint64_t rng = seed;
+	if (b->open(&state, b->type) < 0)
+		return -1;
+	const uint64_t start = now();
+	for (size_t i = 0; i < ops; i++)
+		fails += !w->op(b, state, s, &rng);
+	const uint64_t elapsed = now() - start;
+	drain(b, state, s);
+	b->close(state);
+
+	if (b->open(&state, b->type) < 0)
+		return -1;
+	rng = seed;
+	for (size_t i = 0; i < ops; i++) {
+		const uint64_t t = now();
+		(void)w->op(b, state, s, &rng);
+		const uint64_t d = now() - t;
+		lat[i] = d > UINT32_MAX ? UINT32_MAX : (uint32_t)d;
+	}
+	if (b->stats)
+		b->stats(state, &peak, &frag);
+	drain(b, state, s);
+	b->close(state);
+	qsort(lat, ops, sizeof (lat[0]), compare);
+
+	char f[16] = "-", p[32] = "-";
+	if (frag >= 0.0)
+		(void)snprintf(f, sizeof f, "%.3f", frag);
+	if (b->stats)
+		(void)snprintf(p, sizeof p, "%zu", peak / 1024u);
+	return fprintf(out, "%-8s %-8s %9.2f %6lu %6lu %7lu %10s %6s %8zu\n", w->name, b->name,
+		elapsed ? ((double)ops * 1000.0) / (double)elapsed : 0.0,
+		(unsigned long)lat[ops / 2u], (unsigned long)lat[(ops * 99u) / 100u], (unsigned long)lat[(ops * 999u) / 1000u],
+		p, f, fails);
+}
+
+int main(int argc, char **argv) {
+	FILE *out = stdout;
+	const size_t ops = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000ul;
+	const uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 0) : 0x9E3779B97F4A7C15ull;
+	int r = 0;
+	arena_buf = malloc(BENCH_ARENA);
+	cache_buf = malloc(BENCH_ARENA / 16u);
+	kr_heap = malloc(BENCH_ARENA * 4u); /* 'kr_malloc' cannot fail gracefully, so it must not run out */
+	slot_t *s = calloc(BENCH_SLOTS + 1u, sizeof (*s));
+	uint32_t *lat = malloc((ops ? ops : 1u) * sizeof (*lat));
+	if (!arena_buf || !cache_buf || !kr_heap || !s || !lat || !ops || !seed) {
+		(void)fprintf(stderr, "usage: %s [operations] [non-zero seed]\n", argv[0]);
+		r = 1;
+		goto end;
+	}
+	(void)fprintf(out, "%-8s %-8s %9s %6s %6s %7s %10s %6s %8s\n",
+		"workload", "backend", "Mops/s", "p50", "p99", "p99.9", "peak(KiB)", "frag", "fails");
+	for (size_t i = 0; i < sizeof (workloads) / sizeof (workloads[0]); i++)
+		for (size_t j = 0; j < sizeof (backends) / sizeof (backends[0]); j++)
+			if (run(out, &workloads[i], &backends[j], ops, seed, s, lat) < 0) {
+				(void)fprintf(stderr, "%s: %s failed\n", workloads[i].name, backends[j].name);
+				r = 1;
+			}
+end:
+	free(arena_buf);
+	free(cache_buf);
+	free(kr_heap);
+	free(s);
+	free(lat);
+	return r;
+}
@@ -14,8 +14,20 @@
  * allocator must be aligned to the strictest alignment required by your
  * system.
  *
- * @bug If block count is not a multiple or the sizeof bitmap_unit_t then
- * not all memory can be allocated.
+ * Free blocks are found a bitmap unit (64 bits) at a time, skipping units
+ * that are completely allocated and then using a count-trailing-zeros
+ * instruction on the inverted unit to find the free bit within it. If SSE2 or
+ * AVX2 is available multiple units are skipped per comparison.
+ *
+ * Arenas made with 'block_new' also keep a hierarchy of summary bitmaps, with
+ * one bit per completely allocated unit of the level below, so a free block
+ * can be found by descending the levels with a count-trailing-zeros on each,
+ * regardless of the arena size or how full it is. Statically declared arenas
+ * have no summary and fall back to scanning the bitmap.
+ *
+ * A pool places the memory for all of its arenas in a single allocation,
+ * each arena starting on a new page, so the arena a pointer belongs to (and
+ * hence its block size) can be found by looking up its page in a table.
  *
  * NOTE: As the structures needed to define a memory pool are available in
  * the header it is possible to allocate pools statically, or even on the
@@ -31,6 +43,7 @@
 #include <limits.h>
 
 #define FIND_BY_BIT (0) /* Slow, simply, find free bit by bit? */
+#define USE_SIMD    (1) /* Use SSE2/AVX2, if available, to skip allocated units? */
 #define STATISTICS  (1) /* Collect statistics on allocations? */
 #define FALLBACK    (0) /* Fallback to malloc/free if we cannot allocate? */
 #define RANDOM_FAIL (0) /* Simulate random failures? (pool allocations only) */
@@ -41,6 +54,11 @@
 #define MAX(X, Y)   ((X) > (Y) ? (X) : (Y))
 #define FAIL_PROBABILITY (RAND_MAX/1000)
 #define FAIL_SEED   (1987)
+#define POOL_PAGE   (4096) /* granularity of the pool pointer to arena map */
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 size_t bitmap_units(size_t bits) {
 	return bits/BITS + !!(bits & MASK);
@@ -90,25 +108,25 @@ bitmap_t *bitmap_copy(const bitmap_t *b) {
 void bitmap_set(bitmap_t *b, size_t bit) {
 	assert(b);
 	assert(bit < b->bits);
-	b->map[bit/BITS] |=  (1u << (bit & MASK));
+	b->map[bit/BITS] |=  ((bitmap_unit_t)1 << (bit & MASK));
 }
 
 void bitmap_clear(bitmap_t *b, size_t bit) {
 	assert(b);
 	assert(bit < b->bits);
-	b->map[bit/BITS] &= ~(1u << (bit & MASK));
+	b->map[bit/BITS] &= ~((bitmap_unit_t)1 << (bit & MASK));
 }
 
 void bitmap_toggle(bitmap_t *b, size_t bit) {
 	assert(b);
 	assert(bit < b->bits);
-	b->map[bit/BITS] ^=  (1u << (bit & MASK));
+	b->map[bit/BITS] ^=  ((bitmap_unit_t)1 << (bit & MASK));
 }
 
 bool bitmap_get(bitmap_t *b, size_t bit) {
 	assert(b);
 	assert(bit < b->bits);
-	return !!(b->map[bit/BITS] & (1u << (bit & MASK)));
+	return !!(b->map[bit/BITS] & ((bitmap_unit_t)1 << (bit & MASK)));
 }
 
 static inline size_t block_count(block_arena_t *a) {
@@ -116,13 +134,48 @@ static inline size_t block_count(block_arena_t *a) {
 	return bitmap_bits(&a->freelist);
 }
 
+static inline unsigned unit_ctz(bitmap_unit_t u) {
+	assert(u);
+#ifdef __GNUC__
+	return __builtin_ctzll(u);
+#else
+	unsigned r = 0;
+	for (; !(u & 1); u >>= 1)
+		r++;
+	return r;
+#endif
+}
+
+/* Return the index of the first unit in [start, end) with a clear bit, or
+ * 'end' if there is none. */
+static inline size_t unit_find_free(const bitmap_unit_t *u, size_t start, size_t end) {
+	assert(u);
+	size_t i = start;
+	if (USE_SIMD) {
+#if defined(__AVX2__)
+		const __m256i ones = _mm256_set1_epi64x(-1);
+		for (; (i + 4) <= end; i += 4) /* 256 blocks per comparison */
+			if (!_mm256_testc_si256(_mm256_loadu_si256((const __m256i*)&u[i]), ones))
+				break;
+#elif defined(__SSE2__)
+		const __m128i ones = _mm_set1_epi32(-1);
+		for (; (i + 2) <= end; i += 2) /* 128 blocks per comparison */
+			if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)&u[i]), ones)) != 0xFFFF)
+				break;
+#endif
+	}
+	for (; i < end; i++)
+		if (u[i] != (bitmap_unit_t)-1)
+			return i;
+	return end;
+}
+
 /* NOTES: Speeding up this function increases the speed of allocation,
  * deallocation is very fast as it is just clearing a bit field, but for
  * allocation it the allocator has to find a free bit which can mean traversing
- * the entire bitfield. Some potential operations include keeping a stack of
- * values just recently freed (like keeping a free list), or micro
- * optimizations such as using a highly optimized version of 'memchr' if your
- * library provides one. */
+ * the entire bitfield. Recently freed blocks are handed out again first, the
+ * bitmap is then searched a unit at a time (or more with SIMD) from where the
+ * last allocation was made, wrapping around. */
 static inline long block_find_free(block_arena_t *a) {
 	assert(a);
 	if (FIND_BY_BIT) { /* much slower, simpler */
@@ -136,25 +189,61 @@ static inline long block_find_free(block_arena_t *a) {
 	if (a->lastfree) {
 		const long r = a->lastfree;
 		a->lastfree = 0;
-		bitmap_get(&a->freelist, r);
-		return r;
+		if (!bitmap_get(&a->freelist, r))
+			return r;
+	}
+	if (a->levels) {
+		const size_t top = a->levels - 1;
+		bitmap_unit_t *s = a->summary[top];
+		const size_t units = bitmap_units(a->summary_bits[top]);
+		const size_t i = unit_find_free(s, 0, units);
+		if (i >= units)
+			return -1;
+		size_t index = (i * BITS) + unit_ctz(~s[i]);
+		for (size_t level = top; level-- > 0;)
+			index = (index * BITS) + unit_ctz(~a->summary[level][index]);
+		const size_t j = (index * BITS) + unit_ctz(~a->freelist.map[index]);
+		assert(j < a->freelist.bits);
+		return j;
 	}
 	bitmap_t *b = &a->freelist;
 	bitmap_unit_t *u = b->map;
-	size_t max = bitmap_unit_index(b->bits), start = bitmap_unit_index(a->lastalloc);
-	for (size_t c = 0, i = start; c <= max; i = (i + 1) % (max ? max : 1) /*& (max - 1)*/, c++)
-		if (u[i] != (bitmap_unit_t)-1uLL) {
-			const size_t index = i * BITS;
-			const size_t end = MIN(b->bits, (index + BITS));
-			for (size_t j = index; j < end; j++)
-				if (!bitmap_get(b, j)) {
-					a->lastalloc = j;
-					return j;
-				}
+	const size_t units = bitmap_units(b->bits), start = bitmap_unit_index(a->lastalloc);
+	for (size_t pass = 0, from = start, to = units; pass < 2; pass++, from = 0, to = start) {
+		for (size_t i = unit_find_free(u, from, to); i < to; i = unit_find_free(u, i + 1, to)) {
+			const size_t j = (i * BITS) + unit_ctz(~u[i]);
+			if (j >= b->bits) /* free bits past the end of the last unit */
+				break;
+			a->lastalloc = j;
+			return j;
 		}
+	}
 	return -1;
 }
 
+/* Propagate a unit becoming full up through the summary levels */
+static inline void summary_set(block_arena_t *a, size_t unit) {
+	assert(a);
+	for (size_t level = 0; level < a->levels; level++, unit /= BITS) {
+		bitmap_unit_t *s = &a->summary[level][unit / BITS];
+		*s |= (bitmap_unit_t)1 << (unit & MASK);
+		if (*s != (bitmap_unit_t)-1)
+			break;
+	}
+}
+
+/* Propagate a full unit gaining a free bit up through the summary levels */
+static inline void summary_clear(block_arena_t *a, size_t unit) {
+	assert(a);
+	for (size_t level = 0; level < a->levels; level++, unit /= BITS) {
+		bitmap_unit_t *s = &a->summary[level][unit / BITS];
+		const bool full = *s == (bitmap_unit_t)-1;
+		*s &= ~((bitmap_unit_t)1 << (unit & MASK));
+		if (!full)
+			break;
+	}
+}
+
 static inline bool is_aligned(void *v) {
 	assert(v);
 	uintptr_t p = (uintptr_t)v;
@@ -184,6 +273,8 @@ void *block_malloc(block_arena_t *a, size_t length) {
 			a->max = a->active;
 	}
 	bitmap_set(&a->freelist, f);
+	if (a->freelist.map[bitmap_unit_index(f)] == (bitmap_unit_t)-1)
+		summary_set(a, bitmap_unit_index(f));
 	void *r = ((char*)a->memory) + (f * a->blocksz);
 	assert(is_aligned(r));
 	return r;
@@ -201,7 +292,7 @@ void *block_calloc(block_arena_t *a, size_t length) {
 static inline int block_arena_valid_pointer(block_arena_t *a, void *v) {
 	assert(a);
 	const size_t max = block_count(a);
-	if (v < a->memory || (char*)v > ((char*)a->memory + (max * a->blocksz)))
+	if (v < a->memory || (char*)v >= ((char*)a->memory + (max * a->blocksz)))
 		return 0;
 	return 1;
 }
@@ -224,6 +315,8 @@ int block_free(block_arena_t *a, void *v) {
 	}
 	if (STATISTICS)
 		a->active--;
+	if (a->freelist.map[bitmap_unit_index(bit)] == (bitmap_unit_t)-1)
+		summary_clear(a, bitmap_unit_index(bit));
 	bitmap_clear(&a->freelist, bit);
 	a->lastfree = bit;
 	return 0;
@@ -246,11 +339,22 @@ void block_delete(block_arena_t *a) {
 	if (!a)
 		return;
 	free(a->freelist.map);
+	for (size_t i = 0; i < BLOCK_LEVELS; i++)
+		free(a->summary[i]);
 	free(a->memory);
 	free(a);
 }
 
-block_arena_t *block_new(size_t blocksz, size_t count) {
+/* Bits past the end of the last unit of each level are set so that they are
+ * never found to be free, and so that the last unit can become full. */
+static void bitmap_unit_fill_tail(bitmap_unit_t *map, size_t bits) {
+	assert(map);
+	if (bits & MASK)
+		map[bits / BITS] |= ~(bitmap_unit_t)0 << (bits & MASK);
+}
+
+/* 'memory' is allocated if NULL, otherwise it is owned by the caller */
+static block_arena_t *block_make(size_t blocksz, size_t count, void *memory) {
 	block_arena_t *a = NULL;
 	if (blocksz < sizeof(intptr_t))
 		goto fail;
@@ -258,44 +362,129 @@ block_arena_t *block_new(size_t blocksz, size_t count) {
 		goto fail;
 	if (!(a = calloc(sizeof(*a), 1)))
 		goto fail;
-	a->freelist.map = calloc((count / sizeof(bitmap_unit_t)) + sizeof(bitmap_unit_t), 1);
-	a->memory       = calloc(blocksz, count);
-	if (!(a->freelist.map) || !(a->memory))
+	a->freelist.map = calloc(bitmap_units(count) + 1, sizeof(bitmap_unit_t));
+	a->memory       = memory ? NULL : calloc(blocksz, count);
+	if (!(a->freelist.map) || !(memory || a->memory))
 		goto fail;
 	a->freelist.bits = count;
 	a->blocksz = blocksz;
+	bitmap_unit_fill_tail(a->freelist.map, count);
+	for (size_t bits = bitmap_units(count); bits > 1 && a->levels < BLOCK_LEVELS; bits = bitmap_units(bits)) {
+		if (!(a->summary[a->levels] = calloc(bitmap_units(bits), sizeof(bitmap_unit_t))))
+			goto fail;
+		bitmap_unit_fill_tail(a->summary[a->levels], bits);
+		a->summary_bits[a->levels++] = bits;
+	}
+	if (memory)
+		a->memory = memory;
 	return a;
 fail:
 	block_delete(a);
 	return NULL;
 }
 
+block_arena_t *block_new(size_t blocksz, size_t count) {
+	return block_make(blocksz, count, NULL);
+}
+
 void pool_delete(pool_t *p) {
 	if (!p)
 		return;
 	if (p->tracer)
 		p->tracer(p->tracer_arg, "{delete %p}", (void*)p);
 	if (p->arenas)
-		for (size_t i = 0; i < p->count; i++)
+		for (size_t i = 0; i < p->count; i++) {
+			if (p->arenas[i]) /* memory is owned by the pool */
+				p->arenas[i]->memory = NULL;
 			block_delete(p->arenas[i]);
+		}
 	free(p->arenas);
+	free(p->page_map);
+	free(p->memory);
 	free(p);
 }
 
+static inline size_t pool_arena_pages(const pool_specification_t *spec) {
+	assert(spec);
+	return ((spec->blocksz * spec->count) + POOL_PAGE - 1) / POOL_PAGE;
+}
+
+/* Return the index of the arena 'v' belongs to, or -1 */
+static inline long pool_arena_index(pool_t *p, void *v) {
+	assert(p);
+	char *c = v;
+	if (!p->memory || c < p->memory || c >= (p->memory + (p->pages * POOL_PAGE)))
+		return -1;
+	const size_t i = p->page_map[(c - p->memory) / POOL_PAGE];
+	if (i >= p->count || !block_arena_valid_pointer(p->arenas[i], v))
+		return -1;
+	return i;
+}
+
+static inline size_t ceil_log2(size_t length) {
+	if (length <= 1)
+		return 0;
+#ifdef __GNUC__
+	return (sizeof(unsigned long long) * CHAR_BIT) - __builtin_clzll(length - 1);
+#else
+	size_t r = 0;
+	for (length--; length; length >>= 1)
+		r++;
+	return r;
+#endif
+}
+
+/* Arenas are sorted by block size and a table mapping the logarithm of
+ * the allocation length to the best fitting arena is built, block sizes are
+ * powers of two so this is exact. */
+static int pool_build_lookup(pool_t *p) {
+	assert(p);
+	if (p->count >= UCHAR_MAX)
+		return -1;
+	for (size_t i = 1; i < p->count; i++) /* insertion sort, stable */
+		for (size_t j = i; j && p->arenas[j - 1]->blocksz > p->arenas[j]->blocksz; j--) {
+			block_arena_t *t = p->arenas[j];
+			p->arenas[j] = p->arenas[j - 1];
+			p->arenas[j - 1] = t;
+		}
+	for (size_t k = 0, i = 0; k < sizeof(p->lookup); k++) {
+		while (i < p->count && ceil_log2(p->arenas[i]->blocksz) < k)
+			i++;
+		p->lookup[k] = i;
+	}
+	return 0;
+}
+
 pool_t *pool_new(size_t length, const pool_specification_t *specs) {
 	assert(specs);
 	pool_t *p = calloc(sizeof *p, 1);
 	if (!p)
 		goto fail;
+	p->spill = POOL_SPILL_ALL;
 	p->count = length;
 	p->arenas = calloc(sizeof(p->arenas[0]), p->count);
 	if (!(p->arenas))
 		goto fail;
-	for (size_t i = 0; i < length; i++) {
+	for (size_t i = 0; i < length; i++)
+		p->pages += pool_arena_pages(&specs[i]);
+	p->memory = calloc(p->pages ? p->pages : 1, POOL_PAGE);
+	p->page_map = calloc(p->pages ? p->pages : 1, sizeof(p->page_map[0]));
+	if (!(p->memory) || !(p->page_map))
+		goto fail;
+	for (size_t i = 0, page = 0; i < length; i++) {
 		const pool_specification_t spec = specs[i];
-		p->arenas[i] = block_new(spec.blocksz, spec.count);
+		p->arenas[i] = block_make(spec.blocksz, spec.count, p->memory + (page * POOL_PAGE));
 		if (!(p->arenas[i]))
 			goto fail;
+		page += pool_arena_pages(&spec);
+	}
+	if (pool_build_lookup(p) < 0)
+		goto fail;
+	for (size_t i = 0; i < p->count; i++) { /* map pages to sorted arena indices */
+		block_arena_t *a = p->arenas[i];
+		const size_t first = ((char*)a->memory - p->memory) / POOL_PAGE;
+		const size_t pages = ((a->blocksz * block_count(a)) + POOL_PAGE - 1) / POOL_PAGE;
+		memset(&p->page_map[first], (int)i, pages);
 	}
 	if (RANDOM_FAIL)
 		srand(FAIL_SEED);
@@ -316,7 +505,9 @@ void *pool_malloc(pool_t *p, size_t length) {
 		}
 	if (STATISTICS)
 		p->allocs++, p->total += length;
-	for (size_t i = 0; i < p->count; i++)
+	const size_t first = p->lookup[ceil_log2(length)];
+	const size_t last = (p->count - first) > p->spill ? first + p->spill + 1 : p->count;
+	for (size_t i = first; i < last; i++)
 		if ((r = block_malloc(p->arenas[i], length))) {
 			if (STATISTICS) {
 				const size_t bsz = p->arenas[i]->blocksz;
@@ -340,6 +531,22 @@ void *pool_calloc(pool_t *p, size_t length) {
 	return r ? memset(r, 0, length) : r;
 }
 
+static int pool_free_arena(pool_t *p, long i, void *v) {
+	assert(p);
+	if (i < 0) {
+		if (FALLBACK) {
+			free(v);
+			return 0;
+		}
+		if (USE_ABORT)
+			abort();
+		return -1;
+	}
+	if (STATISTICS)
+		p->active -= p->arenas[i]->blocksz;
+	return block_free(p->arenas[i], v);
+}
+
 int pool_free(pool_t *p, void *v) {
 	assert(p);
 	if (p->tracer)
@@ -348,40 +555,19 @@ int pool_free(pool_t *p, void *v) {
 		return 0;
 	if (STATISTICS)
 		p->freed++;
-	for (size_t i = 0; i < p->count; i++) {
-		if (block_arena_valid_pointer(p->arenas[i], v)) {
-			if (STATISTICS)
-				p->active -= p->arenas[i]->blocksz;
-			return block_free(p->arenas[i], v);
-		}
-	}
-	if (FALLBACK) {
-		free(v);
-		return 0;
-	}
-	if (USE_ABORT)
-		abort();
-	return -1;
+	return pool_free_arena(p, pool_arena_index(p, v), v);
 }
 
 size_t pool_block_size(pool_t *p, void *v) {
 	assert(p);
-	for (size_t i = 0; i < p->count; i++)
-		if (block_arena_valid_pointer(p->arenas[i], v))
-			return p->arenas[i]->blocksz;
+	const long i = pool_arena_index(p, v);
+	if (i >= 0)
+		return p->arenas[i]->blocksz;
 	if (USE_ABORT)
 		abort();
 	return 0; /*WARNING: Returns zero! Which is kind-of and invalid value... */
 }
 
-static inline bool pool_valid_pointer(pool_t *p, void *v) {
-	assert(p);
-	for (size_t i = 0; i < p->count; i++)
-		if (block_arena_valid_pointer(p->arenas[i], v))
-			return true;
-	return false;
-}
-
 void *pool_realloc(pool_t *p, void *v, size_t length) {
 	assert(p);
 	if (STATISTICS)
@@ -392,19 +578,28 @@ void *pool_realloc(pool_t *p, void *v, size_t length) {
 	}
 	if (!v)
 		return pool_malloc(p, length);
+	const long i = pool_arena_index(p, v);
 	if (FALLBACK)
-		if (!pool_valid_pointer(p, v))
+		if (i < 0)
 			return realloc(v, length);
-	const size_t oldsz = pool_block_size(p, v);
+	if (i < 0) {
+		if (USE_ABORT)
+			abort();
+		return NULL;
+	}
+	const size_t oldsz = p->arenas[i]->blocksz;
 	const size_t minsz = MIN(oldsz, length);
-	assert(oldsz != 0);
 	if (length > (oldsz/2) && length < oldsz)
 		return v;
 	void *n = pool_malloc(p, length);
 	if (!n)
 		return NULL;
 	memcpy(n, v, minsz);
-	pool_free(p, v);
+	if (p->tracer)
+		p->tracer(p->tracer_arg, "{free   %p: %p}", (void*)p, v);
+	if (STATISTICS)
+		p->freed++;
+	pool_free_arena(p, i, v);
 	return n;
 }
 
@@ -447,6 +642,48 @@ int block_tests(void) {
 			break;
 	if (i != BLK_COUNT)
 		return -6;
+	const size_t count = (BITS * BITS * BITS) + 5; /* three summary levels */
+	block_arena_t *b = block_new(BLK_SIZE, count);
+	if (!b || b->levels != 3)
+		return -7;
+	char *first = block_malloc(b, 1), *v = first;
+	for (i = 1; v; i++)
+		v = block_malloc(b, 1);
+	if (i != (count + 1))
+		return -8;
+	const size_t holes[] = { 0, BITS - 1, BITS * BITS * BITS, count - 1, };
+	for (i = 0; i < (sizeof holes / sizeof holes[0]); i++)
+		if (block_free(b, first + (holes[i] * BLK_SIZE)) < 0)
+			return -9;
+	for (i = 0; i < (sizeof holes / sizeof holes[0]); i++) {
+		if (!(v = block_malloc(b, 1)))
+			return -10;
+		const size_t index = (v - first) / BLK_SIZE;
+		if (index != holes[0] && index != holes[1] && index != holes[2] && index != holes[3])
+			return -11;
+	}
+	if (block_malloc(b, 1))
+		return -12;
+	block_delete(b);
+	const pool_specification_t specs[] = { { 64, 1 }, { 16, 1 }, { 32, 1 }, };
+	pool_t *p = pool_new(sizeof specs / sizeof specs[0], specs);
+	if (!p)
+		return -13;
+	p->spill = POOL_SPILL_NONE;
+	if (pool_block_size(p, (v = pool_malloc(p, 20))) != 32)
+		return -14;
+	if (pool_malloc(p, 20))
+		return -15;
+	p->spill = POOL_SPILL_ALL;
+	if (pool_block_size(p, pool_malloc(p, 20)) != 64)
+		return -16;
+	if (pool_malloc(p, 65))
+		return -17;
+	if (pool_free(p, p) >= 0 || pool_block_size(p, p))
+		return -18;
+	if (pool_free(p, v) < 0 || pool_realloc(p, pool_malloc(p, 1), 0))
+		return -19;
+	pool_delete(p);
 	return 0;
 }
 #endif
@@ -35,16 +35,23 @@ extern "C" {
 #endif
 
 #include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdbool.h>
 
-typedef unsigned bitmap_unit_t;
+typedef uint64_t bitmap_unit_t;
 typedef struct {
 	size_t bits;
 	bitmap_unit_t *map;
 } bitmap_t;
 
+#define BLOCK_LEVELS (4) /* maximum number of summary bitmap levels */
+
 typedef struct {
 	bitmap_t freelist; /* list of free blocks */
+	bitmap_unit_t *summary[BLOCK_LEVELS]; /* a set bit in level N means unit of level N-1 (or 'freelist') is full */
+	size_t summary_bits[BLOCK_LEVELS]; /* bits in each summary level */
+	size_t levels;     /* summary levels in use, zero if there is no summary */
 	size_t blocksz;    /* size of a block: 1, 2, 4, 8, ... */
 	size_t lastalloc, lastfree;   /* last freed block */
 	void *memory;      /* memory backing this allocator, should be aligned! */
@@ -53,9 +60,17 @@ typedef struct {
 
 typedef void (*pool_tracer_func_t)(void *v, const char *fmt, ...);
 
+#define POOL_SPILL_NONE (0)         /* fail if the best fitting arena is full */
+#define POOL_SPILL_ALL  ((size_t)-1) /* try every larger arena if the best fitting arena is full */
+
 typedef struct {
 	size_t count;
-	block_arena_t **arenas;
+	block_arena_t **arenas; /* sorted by block size */
+	unsigned char lookup[sizeof(size_t) * CHAR_BIT + 1]; /* ceil(log2(length)) -> index of best fitting arena */
+	size_t spill; /* number of larger arenas to try when the best fit is full, defaults to POOL_SPILL_ALL */
+	char *memory; /* memory for all arenas, each starting on a new page */
+	size_t pages; /* length of 'memory' in pages */
+	unsigned char *page_map; /* page of 'memory' -> index of owning arena */
 
 	/* statistics collection */
 	long freed, allocs, relocations; /* non NULL frees, malloc/callocs, reallocs */
@@ -81,7 +96,7 @@ void bitmap_clear(bitmap_t *b, size_t bit);
 void bitmap_toggle(bitmap_t *b, size_t bit);
 bool bitmap_get(bitmap_t *b, size_t bit);
 
-block_arena_t *block_new(size_t blocksz, size_t count); /* count should be divisible by bitmap_unit_t */
+block_arena_t *block_new(size_t blocksz, size_t count); /* blocksz must be a power of two, count can be any number */
 void block_delete(block_arena_t *a);
 
 void *block_malloc(block_arena_t *a, size_t length);
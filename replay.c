@@ -0,0 +1,122 @@
+/* Richard James Howe, Email: howe.r.j.89@gmail.com, Public Domain, https:github.com/howerj/allocator */
+
+/* Replay a trace, written by a record callback as a stream of events each
+ * encoded with 'allocator_event_encode', against an arena of any type:
+ *
+ * 	allocator-replay trace.bin [type] [arena-bytes]
+ *
+ * For example a record callback that writes a trace to a file is:
+ *
+ * 	static int record(void *param, const allocator_event_t *e) {
+ * 		unsigned char b[ALLOCATOR_EVENT_MAX];
+ * 		const size_t n = allocator_event_encode(e, b, sizeof b);
+ * 		return fwrite(b, 1, n, param) == n ? 0 : -1;
+ * 	} */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#include "allocator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const struct { const char *name; int type; } types[] = {
+	{ "list",    ALLOCATOR_TYPE_LIST },
+	{ "sized",   ALLOCATOR_TYPE_LIST | ALLOCATOR_FLAG_SIZED },
+	{ "pool",    ALLOCATOR_TYPE_POOL },
+	{ "buddy",   ALLOCATOR_TYPE_BUDDY },
+	{ "no-free", ALLOCATOR_TYPE_NO_FREE },
+	{ "multi",   ALLOCATOR_TYPE_MULTI },
+};
+
+static double now(void) {
+	struct timespec ts;
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+}
+
+static unsigned char *slurp(const char *file, size_t *len) {
+	FILE *f = fopen(file, "rb");
+	unsigned char *r = NULL;
+	size_t cap = 0;
+	*len = 0;
+	if (!f)
+		return NULL;
+	for (size_t n = 1; n;) {
+		if (*len == cap) {
+			unsigned char *g = realloc(r, (cap = (cap * 2u) + 4096u));
+			if (!g)
+				goto fail;
+			r = g;
+		}
+		n = fread(&r[*len], 1, cap - *len, f);
+		*len += n;
+	}
+	if (ferror(f))
+		goto fail;
+	(void)fclose(f);
+	return r;
+fail:
+	free(r);
+	(void)fclose(f);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	FILE *out = stdout;
+	int type = ALLOCATOR_TYPE_LIST, r = 1;
+	const size_t size = argc > 3 ? strtoul(argv[3], NULL, 0) : 64ul * 1024ul * 1024ul;
+	if (argc < 2 || argc > 4) {
+		(void)fprintf(stderr, "usage: %s trace [type] [arena-bytes]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2) {
+		type = -1;
+		for (size_t i = 0; i < sizeof (types) / sizeof (types[0]); i++)
+			if (!strcmp(argv[2], types[i].name))
+				type = types[i].type;
+		if (type < 0) {
+			(void)fprintf(stderr, "unknown type '%s'\n", argv[2]);
+			return 1;
+		}
+	}
+	size_t len = 0, events = 0;
+	unsigned char *trace = slurp(argv[1], &len), *buf = malloc(size);
+	allocator_replay_t *map = NULL;
+	void *arena = NULL;
+	if (!trace || !buf) {
+		(void)fprintf(stderr, "unable to read '%s'\n", argv[1]);
+		goto end;
+	}
+	for (size_t n = 0, m = 1; n < len && m; n += m, events++) { /* the map never needs more entries than events */
+		allocator_event_t e;
+		m = allocator_event_decode(&e, &trace[n], len - n);
+	}
+	if (!(map = calloc((events * 2u) + 1u, sizeof (*map)))) /* half full, so probes are short */
+		goto end;
+	const int fmt = (type & ALLOCATOR_TYPE_MASK) == ALLOCATOR_TYPE_MULTI ?
+		allocator_format_multi(&arena, ALLOCATOR_TYPE_LIST, 4, buf, size) :
+		allocator_format(&arena, type, buf, size);
+	if (fmt < 0) {
+		(void)fprintf(stderr, "unable to format arena\n");
+		goto end;
+	}
+	const double start = now();
+	const int fails = allocator_replay(arena, trace, len, map, (events * 2u) + 1u);
+	const double elapsed = now() - start;
+	allocator_stats_t s;
+	if (fails < 0 || allocator_get_stats(arena, &s) < 0) {
+		(void)fprintf(stderr, "replay failed, trace malformed\n");
+		goto end;
+	}
+	(void)fprintf(out, "events=%zu fails=%d seconds=%.6f\n", events, fails, elapsed);
+	(void)fprintf(out, "total=%zu used=%zu free=%zu overhead=%zu peak=%zu largest=%zu\n", s.total, s.used, s.free, s.overhead, s.peak, s.largest);
+	(void)fprintf(out, "allocs=%zu frees=%zu reallocs=%zu\n", s.allocs, s.frees, s.reallocs);
+	r = 0;
+end:
+	free(trace);
+	free(buf);
+	free(map);
+	return r;
+}